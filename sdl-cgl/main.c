@@ -1,4 +1,16 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS */
+
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include <time.h>
 #include <omp.h>
 #include <SDL.h>
@@ -23,9 +35,130 @@ pixel_t colors[NUM_STATES] = {
     [ALIVE]  = 0x404040ff
 };
 
+/*
+ * Outer totalistic rule in B/S notation. Bit n of rule_births is set if a dead
+ * cell with n alive neighbors is born, bit n of rule_survivals if an alive one
+ * survives. The engines use rule_table, compiled from them by set_rule().
+ */
+int rule_births = 1 << 3;
+int rule_survivals = 1 << 2 | 1 << 3;
+int rule_conway = 1;
+uint8_t rule_table[NUM_STATES][9];
+char rule_name[32] = "B3/S23";
+int rule_fixed = 0; /* Given with -r, pattern files do not override it */
+
+enum {
+    ENGINE_SCALAR,
+    ENGINE_BITS,
+    ENGINE_HASHLIFE,
+    ENGINE_SPARSE,
+    NUM_ENGINES
+};
+
+const char *engine_names[NUM_ENGINES] = {
+    [ENGINE_SCALAR]   = "scalar",
+    [ENGINE_BITS]     = "bits",
+    [ENGINE_HASHLIFE] = "hashlife",
+    [ENGINE_SPARSE]   = "sparse"
+};
+
+int engine = ENGINE_BITS;
+
 cell_t *cell_grid_a = NULL; /* Always points to the last modified grid */
 cell_t *cell_grid_b = NULL;
 
+/* Bit-packed grids, 64 cells per word, bit i of a word is cell 64 * w + i */
+uint64_t *bit_grid_a = NULL; /* Always points to the last modified grid */
+uint64_t *bit_grid_b = NULL;
+uint64_t *zero_row = NULL;
+
+int words_w = 0;
+
+/*
+ * Active region tracking. The grid is divided into tiles, and a tile changed
+ * flag is kept per generation. Tiles are one word of the bit grid wide.
+ */
+#define TILE_W 64
+#define TILE_H 16
+
+uint8_t *tile_changed_a = NULL; /* Changed in the last generation */
+uint8_t *tile_changed_b = NULL;
+
+int tiles_w = 0,
+    tiles_h = 0;
+
+int tiles_skipped = 0; /* In the last generation */
+
+uint8_t *tile_dirty = NULL; /* Repainted since the last frame */
+uint8_t *tile_sent = NULL;  /* Since the last frame taken, up to the last one */
+int all_dirty = 0;          /* Whole texture repainted since the last frame */
+
+int track_active = 1;
+
+/*
+ * Periodicity detection. grid_hash is a Zobrist hash of the grid, the XOR of
+ * one key per alive cell, kept up to date from the cells that change. Hashes
+ * of past generations are stored in a direct-mapped table, and finding the
+ * current hash there means the grid entered a cycle. Collisions in the table
+ * only overwrite older generations, which can delay the detection.
+ */
+#define HISTORY_SIZE (1 << 16)
+
+typedef struct {
+    uint64_t hash;
+    uint64_t seen; /* Generation + 1, 0 for empty slots */
+} history_t;
+
+enum {
+    CYCLES_OFF,
+    CYCLES_REPORT,
+    CYCLES_STOP,
+    CYCLES_QUIET    /* Stop without reporting, for soups */
+};
+
+int detect_cycles = CYCLES_OFF;
+uint64_t grid_hash = 0;
+history_t *history = NULL;
+uint64_t cycle_start = 0;
+uint64_t cycle_period = 0; /* 0 until a cycle is found */
+
+/*
+ * Grid files. With -M the grids of the 'bits' or 'scalar' engine live in a
+ * memory-mapped file instead of the heap, so the kernel pages them in and out
+ * as tiles are stepped and grids may be larger than memory. After a header
+ * page, the file holds the two grids and two checkpoint slots. A checkpoint
+ * copies the tiles changed since the slot was last written into the older
+ * slot, syncs it, then points the header to it, so only dirty pages are
+ * written and a crash during a checkpoint leaves the previous one intact.
+ * Opening an existing file resumes from its last checkpoint.
+ */
+#define GRID_MAGIC "CGLGRID"
+#define GRID_VERSION 1
+#define GRID_PAGE 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t engine;
+    int32_t width, height;
+    int32_t births, survivals;
+    uint64_t generation; /* Of the checkpoint */
+    uint32_t slot;       /* Holding the checkpoint */
+} grid_header_t;
+
+uint8_t *grid_map = NULL;
+size_t grid_map_size = 0;
+size_t grid_bytes = 0;          /* One grid, in whole pages */
+grid_header_t *grid_header = NULL;
+uint8_t *grid_slots[2] = { NULL, NULL };
+/* Bit k is set if the tile changed since slot k was saved */
+uint8_t *tile_unsaved = NULL;
+uint64_t checkpoint_interval = 0;
+
+int verbose = 0;
+
+uint64_t generation = 0;
+
 pixel_t *pixels = NULL;
 
 #define WIDTH 800
@@ -41,14 +174,50 @@ SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
 
-#define grid_a(x, y) cell_grid_a[(texture_w * (y)) + (x)]
-#define grid_b(x, y) cell_grid_b[(texture_w * (y)) + (x)]
-#define pixel(x, y) pixels[(texture_w * (y)) + (x)]
+#define grid_a(x, y) cell_grid_a[((size_t)texture_w * (y)) + (x)]
+#define grid_b(x, y) cell_grid_b[((size_t)texture_w * (y)) + (x)]
+#define pixel(x, y) pixels[((size_t)texture_w * (y)) + (x)]
+
+#define bits_a(w, y) bit_grid_a[((size_t)words_w * (y)) + (w)]
+#define bits_b(w, y) bit_grid_b[((size_t)words_w * (y)) + (w)]
+#define bit_a(x, y) (int)((bits_a((x) >> 6, y) >> ((x) & 63)) & 1)
+
+#define set_bit(x, y, s)                                            \
+do {                                                                \
+    uint64_t mask = (uint64_t)1 << ((x) & 63);                      \
+    bits_a((x) >> 6, y) = (bits_a((x) >> 6, y) & ~mask) | ((s) ? mask : 0); \
+} while (0)
+
+/* Headless runs have no pixel buffer */
+#define paint(x, y, s)              \
+do {                                \
+    if (pixels)                     \
+    {                               \
+        pixel(x, y) = colors[s];    \
+        tile_dirty[tiles_w * ((y) / TILE_H) + ((x) / TILE_W)] = 1; \
+    }                               \
+} while (0)
+
+#define mark_tile(x, y)                                             \
+do {                                                                \
+    tile_changed_a[tiles_w * ((y) / TILE_H) + ((x) / TILE_W)] = 1;  \
+    if (tile_unsaved)                                               \
+        tile_unsaved[tiles_w * ((y) / TILE_H) + ((x) / TILE_W)] = 3; \
+} while (0)
 
-#define set_cell_state(x, y, s) \
-do {                            \
-    grid_a(x, y).state = s;     \
-    pixel(x, y) = colors[s];    \
+#define set_cell_state(x, y, s)     \
+do {                                \
+    if (engine == ENGINE_BITS)      \
+        set_bit(x, y, s);           \
+    else if (engine == ENGINE_HASHLIFE) \
+        hl_set_cell(x, y, s);       \
+    else if (engine == ENGINE_SPARSE) \
+        sp_set_cell(x, y, s);       \
+    else                            \
+        grid_a(x, y).state = s;     \
+    if (engine <= ENGINE_BITS)      \
+        mark_tile(x, y);            \
+    paint(x, y, s);                 \
 } while (0)
 
 void swap(cell_t **a, cell_t **b)
@@ -58,39 +227,83 @@ void swap(cell_t **a, cell_t **b)
     *b = c;
 }
 
-void seed_cell_grid(SDL_Texture *texture)
+void swap_bits(uint64_t **a, uint64_t **b)
 {
-    int dx = texture_w / 4;
-    int dy = texture_h / 4;
-    int xbound[2] = { dx, texture_w - dx };
-    int ybound[2] = { dy, texture_h - dy };
+    uint64_t *c = *a;
+    *a = *b;
+    *b = c;
+}
 
-    for (int y = ybound[0]; y < ybound[1]; y++)
-        for (int x = xbound[0]; x < xbound[1]; x++)
-            set_cell_state(x, y, ALIVE);
+/*
+ * Parses a rule in B/S notation, "B36/S23", or in the older S/B notation,
+ * "23/36". Returns -1 if the rule is not a valid outer totalistic rule.
+ */
+int parse_rule(const char *str, int *births, int *survivals)
+{
+    const char *p = str;
+    int b = 0, s = 0;
+    int *first = &s, *second = &b;
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+    if (*p == 'B' || *p == 'b')
+    {
+        first = &b;
+        second = &s;
+        p++;
+    }
+
+    while (*p >= '0' && *p <= '8')
+        *first |= 1 << (*p++ - '0');
+
+    if (*p == '/')
+        p++;
+    if (first == &b)
+    {
+        if (*p != 'S' && *p != 's')
+            return -1;
+        p++;
+    }
+
+    while (*p >= '0' && *p <= '8')
+        *second |= 1 << (*p++ - '0');
+
+    if (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        return -1;
+
+    *births = b;
+    *survivals = s;
+    return 0;
 }
 
-/* Transitions cell state base on the classic CGoL rules. */
-void transition(cell_t *cell, int count)
+/* Compiles the rule into rule_table */
+void set_rule(int births, int survivals)
 {
-    int new_state = -1;
+    rule_births = births;
+    rule_survivals = survivals;
+    rule_conway = births == 1 << 3 && survivals == (1 << 2 | 1 << 3);
 
-    switch (cell->state)
+    for (int n = 0; n < 9; n++)
     {
-    case ALIVE:
-        if (count < 2 || count > 3)
-            new_state = DEAD;
-        break;
-    case DEAD:
-        if (count == 3)
-            new_state = ALIVE;
-        break;
+        rule_table[DEAD][n] = (births >> n) & 1 ? ALIVE : DEAD;
+        rule_table[ALIVE][n] = (survivals >> n) & 1 ? ALIVE : DEAD;
     }
 
-    if (new_state != -1)
-        cell->state = new_state;
+    char *p = rule_name;
+    *p++ = 'B';
+    for (int n = 0; n < 9; n++)
+        if ((births >> n) & 1)
+            *p++ = '0' + n;
+    *p++ = '/';
+    *p++ = 'S';
+    for (int n = 0; n < 9; n++)
+        if ((survivals >> n) & 1)
+            *p++ = '0' + n;
+    *p = '\0';
+}
+
+/* Transitions cell state according to the rule, see set_rule(). */
+void transition(cell_t *cell, int count)
+{
+    cell->state = rule_table[cell->state][count];
 }
 
 cell_t next_cell(int x, int y)
@@ -150,102 +363,3106 @@ cell_t next_cell(int x, int y)
     return next;
 }
 
-void evaluate_cell_grid(SDL_Texture *texture)
+/* Key of an alive cell in the grid hash */
+uint64_t zobrist(int x, int y)
 {
-    for (int y = 0; y < texture_h; y++)
-        for (int x = 0; x < texture_w; x++)
+    uint64_t z = ((uint64_t)texture_w * y + x + 1) * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+/* Evaluates one tile, returning whether any of its cells changed */
+int evaluate_cell_tile(int tx, int ty)
+{
+    int changed = 0;
+    uint64_t hash = 0;
+    int x1 = (tx + 1) * TILE_W < texture_w ? (tx + 1) * TILE_W : texture_w;
+    int y1 = (ty + 1) * TILE_H < texture_h ? (ty + 1) * TILE_H : texture_h;
+
+    for (int y = ty * TILE_H; y < y1; y++)
+        for (int x = tx * TILE_W; x < x1; x++)
         {
             cell_t next = next_cell(x, y);
+            if (next.state != grid_a(x, y).state)
+            {
+                paint(x, y, next.state);
+                if (detect_cycles)
+                    hash ^= zobrist(x, y);
+                changed = 1;
+            }
             grid_b(x, y) = next;
-            pixel(x, y) = colors[next.state];
         }
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+    if (hash)
+    {
+        #pragma omp atomic
+        grid_hash ^= hash;
+    }
+
+    return changed;
+}
+
+int tile_active(int tx, int ty)
+{
+    for (int y = ty - 1; y <= ty + 1; y++)
+        for (int x = tx - 1; x <= tx + 1; x++)
+            if (x >= 0 && y >= 0 && x < tiles_w && y < tiles_h
+                && tile_changed_a[tiles_w * y + x])
+                return 1;
+
+    return 0;
+}
+
+/*
+ * Evaluates every active tile. A tile is active if it or one of its neighbors
+ * changed in the previous generation. An inactive tile cannot change, and
+ * since it did not change last generation either, the older grid already
+ * holds its cells, so it is skipped altogether.
+ */
+void evaluate_tiles(int (*evaluate_tile)(int, int))
+{
+    int skipped = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:skipped)
+    for (int t = 0; t < tiles_w * tiles_h; t++)
+    {
+        int tx = t % tiles_w;
+        int ty = t / tiles_w;
+
+        if (track_active && !tile_active(tx, ty))
+        {
+            tile_changed_b[t] = 0;
+            skipped++;
+            continue;
+        }
+
+        tile_changed_b[t] = evaluate_tile(tx, ty);
+        if (tile_unsaved && tile_changed_b[t])
+            tile_unsaved[t] = 3;
+    }
+
+    tiles_skipped = skipped;
+
+    uint8_t *c = tile_changed_a;
+    tile_changed_a = tile_changed_b;
+    tile_changed_b = c;
+}
+
+void evaluate_cell_grid(void)
+{
+    evaluate_tiles(evaluate_cell_tile);
+
     swap(&cell_grid_a, &cell_grid_b);
+    generation++;
 }
 
-int main(int argc, char **argv)
+/* Adds three bit planes, giving the sum bit and the carry bit */
+#define add3(a, b, c, sum, carry)           \
+do {                                        \
+    uint64_t u = (a) ^ (b);                 \
+    sum = u ^ (c);                          \
+    carry = ((a) & (b)) | (u & (c));        \
+} while (0)
+
+/*
+ * Computes the next state of 64 cells at once. Each argument holds the
+ * neighbor in one direction for all 64 cells, and the eight neighbors are
+ * summed with a tree of bit-parallel adders into the count bits b0-b3.
+ */
+uint64_t next_word(
+    uint64_t nw, uint64_t n, uint64_t ne,
+    uint64_t w,  uint64_t c, uint64_t e,
+    uint64_t sw, uint64_t s, uint64_t se)
 {
-    srand(time(NULL));
+    uint64_t sa, ca, sb, cb, b0, cd, t, ce;
 
-    Uint32 flags = SDL_WINDOW_HIDDEN;
+    add3(nw, n, ne, sa, ca);
+    add3(sw, s, se, sb, cb);
+    add3(sa, sb, w ^ e, b0, cd);
+    add3(ca, cb, w & e, t, ce);
 
-    if (SDL_Init(SDL_INIT_VIDEO) == -1)
+    uint64_t b1 = t ^ cd;
+
+    if (rule_conway)
     {
-        fprintf(stderr, "SDL_Init(SDL_INIT_VIDEO) failed: %s\n",
-            SDL_GetError());
-        return 1;
+        uint64_t b2 = ce | (t & cd);
+
+        /*
+         * Count 3, or count 2 and alive. Count 8 wraps to 0 and dies either
+         * way.
+         */
+        return b1 & ~b2 & (b0 | c);
     }
 
-    if (SDL_CreateWindowAndRenderer(0, 0, flags, &window, &renderer) < 0)
+    uint64_t b2 = ce ^ (t & cd);
+    uint64_t b3 = ce & t & cd;
+    uint64_t born = 0, survive = 0;
+
+    /* One term per neighbor count in the rule, selected by its count bits */
+    for (int n = 0; n < 9; n++)
     {
-        fprintf(stderr, "SDL_CreateWindowAndRenderer() failed: %s\n",
-            SDL_GetError());
-        return 1;
+        if (!(((rule_births | rule_survivals) >> n) & 1))
+            continue;
+
+        uint64_t m = (n & 1 ? b0 : ~b0) & (n & 2 ? b1 : ~b1)
+            & (n & 4 ? b2 : ~b2) & (n & 8 ? b3 : ~b3);
+
+        if ((rule_births >> n) & 1)
+            born |= m;
+        if ((rule_survivals >> n) & 1)
+            survive |= m;
     }
 
-    pixels = (pixel_t *)malloc(texture_w * texture_h * sizeof(pixel_t));
+    return (born & ~c) | (survive & c);
+}
 
-    cell_grid_a = (cell_t *)calloc(texture_w * texture_h, sizeof(cell_t));
-    cell_grid_b = (cell_t *)calloc(texture_w * texture_h, sizeof(cell_t));
+/*
+ * Computes word w of a row from the row above, the row itself and the row
+ * below
+ */
+uint64_t evaluate_bit_word(uint64_t *up, uint64_t *mid, uint64_t *down, int w)
+{
+    uint64_t up_prev = 0, mid_prev = 0, down_prev = 0;
+    uint64_t up_next = 0, mid_next = 0, down_next = 0;
 
-    /* Initialize white */
-    memset(pixels, colors[DEAD], texture_w * texture_h * sizeof(pixel_t));
+    if (w > 0)
+    {
+        up_prev = up[w - 1];
+        mid_prev = mid[w - 1];
+        down_prev = down[w - 1];
+    }
 
-    /* Configure texture */
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
-        SDL_TEXTUREACCESS_STREAMING, texture_w, texture_h);
-    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+    if (w + 1 < words_w)
+    {
+        up_next = up[w + 1];
+        mid_next = mid[w + 1];
+        down_next = down[w + 1];
+    }
 
-    /* Stretch texture to rect */
-    SDL_Rect texture_rect;
-    texture_rect.w = window_w;
-    texture_rect.h = window_h;
-    texture_rect.x = 0;
-    texture_rect.y = 0;
+    uint64_t next = next_word(
+        (up[w] << 1) | (up_prev >> 63), up[w],
+        (up[w] >> 1) | (up_next << 63),
+        (mid[w] << 1) | (mid_prev >> 63), mid[w],
+        (mid[w] >> 1) | (mid_next << 63),
+        (down[w] << 1) | (down_prev >> 63), down[w],
+        (down[w] >> 1) | (down_next << 63));
 
-    /* Configure renderer */
-    SDL_SetRenderTarget(renderer, texture);
+    /* Keep the padding bits past the east border dead */
+    if (w == words_w - 1 && (texture_w & 63))
+        next &= ((uint64_t)1 << (texture_w & 63)) - 1;
 
-    /* Configure window */
-    SDL_SetWindowTitle(window, argv[1]);
-    SDL_SetWindowSize(window, window_w, window_h);
-    if (getenv("SDL_FULLSCREEN") != NULL)
-        SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
+    return next;
+}
+
+uint64_t patch_bit(uint64_t word, int x, int y, int count)
+{
+    cell_t cell = { bit_a(x, y) };
+    transition(&cell, count);
+
+    uint64_t mask = (uint64_t)1 << (x & 63);
+    return (word & ~mask) | (cell.state ? mask : 0);
+}
+
+/*
+ * Patches the non-corner border cells in word w of row y. Those only count
+ * their inward neighbor in next_cell(), whereas the word kernel treats the
+ * world as padded with dead cells. The corners agree in both.
+ */
+uint64_t evaluate_bit_border(uint64_t next, int w, int y)
+{
+    int xe = texture_w - 1;
+    int ye = texture_h - 1;
+
+    if (y == 0 || y == ye)
+    {
+        int x0 = w * 64 > 1 ? w * 64 : 1;
+        int x1 = w * 64 + 64 < xe ? w * 64 + 64 : xe;
+        for (int x = x0; x < x1; x++)
+            next = patch_bit(next, x, y, bit_a(x, y == 0 ? 1 : ye - 1));
+    }
     else
-        SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED,
-            SDL_WINDOWPOS_CENTERED);
-    SDL_ShowWindow(window);
+    {
+        if (w == 0)
+            next = patch_bit(next, 0, y, bit_a(1, y));
+        if (w == xe >> 6)
+            next = patch_bit(next, xe, y, bit_a(xe - 1, y));
+    }
+
+    return next;
+}
 
-    seed_cell_grid(texture);
+/* A tile of the bit grid is one word wide, see TILE_W */
+int evaluate_bit_tile(int tx, int ty)
+{
+    uint64_t changed = 0;
+    uint64_t hash = 0;
+    int y1 = (ty + 1) * TILE_H < texture_h ? (ty + 1) * TILE_H : texture_h;
 
-    SDL_bool done = SDL_FALSE;
-    while (!done)
+    for (int y = ty * TILE_H; y < y1; y++)
     {
-        SDL_RenderCopy(renderer, texture, NULL, &texture_rect);
-        SDL_RenderPresent(renderer);
-        SDL_Delay(SLEEPTIME);
-        evaluate_cell_grid(texture);
+        uint64_t next = evaluate_bit_word(
+            y > 0 ? &bits_a(0, y - 1) : zero_row,
+            &bits_a(0, y),
+            y < texture_h - 1 ? &bits_a(0, y + 1) : zero_row,
+            tx);
 
-        SDL_Event event;
-        while (SDL_PollEvent(&event))
+        if (y == 0 || y == texture_h - 1 || tx == 0 || tx == words_w - 1)
+            next = evaluate_bit_border(next, tx, y);
+
+        uint64_t diff = next ^ bits_a(tx, y);
+        bits_b(tx, y) = next;
+        changed |= diff;
+
+        /* Only repaint and rehash the cells that changed */
+        if (!pixels && !detect_cycles)
+            continue;
+
+        while (diff)
         {
-            switch (event.type)
-            {
-            case SDL_QUIT:
-                done = SDL_TRUE;
-                break;
-            case SDL_KEYDOWN:
-                switch (event.key.keysym.sym)
-                {
-                case SDLK_q:
-                    done = SDL_TRUE;
-                    break;
-                }
-            }
+            int b = __builtin_ctzll(diff);
+            paint(64 * tx + b, y, (next >> b) & 1);
+            if (detect_cycles)
+                hash ^= zobrist(64 * tx + b, y);
+            diff &= diff - 1;
+        }
+    }
+
+    if (hash)
+    {
+        #pragma omp atomic
+        grid_hash ^= hash;
+    }
+
+    return changed != 0;
+}
+
+void evaluate_bit_grid(void)
+{
+    evaluate_tiles(evaluate_bit_tile);
+
+    swap_bits(&bit_grid_a, &bit_grid_b);
+    generation++;
+}
+
+/*
+ * HashLife. The universe is an unbounded quadtree of canonical nodes, so equal
+ * regions are stored once, and the successor of every node is memoized. A node
+ * of level L covers 2^L x 2^L cells, level 0 nodes are single cells.
+ */
+typedef struct node {
+    struct node *nw, *ne, *sw, *se;
+    struct node *next;      /* Hash chain */
+    struct node *result;    /* Center advanced 2^step generations */
+    uint64_t population;
+    int level;
+    int step;
+    int mark;
+} node_t;
+
+#define HL_MAX_LEVEL 62
+#define HL_BLOCK 4096
+
+node_t hl_leaves[NUM_STATES] = {
+    [DEAD]  = { .population = 0, .mark = 1 },
+    [ALIVE] = { .population = 1, .mark = 1 }
+};
+
+node_t *hl_empties[HL_MAX_LEVEL + 1];
+
+node_t **hl_table = NULL;
+size_t hl_table_size = 0;
+size_t hl_nodes = 0;
+size_t hl_max_nodes = 1 << 22; /* Garbage collect past this many nodes */
+
+node_t *hl_free = NULL;
+
+node_t *hl_root = NULL; /* Centered on the origin of the texture */
+
+int hl_step_log = 0; /* Generations per step, log2 */
+
+size_t hl_hash(node_t *nw, node_t *ne, node_t *sw, node_t *se)
+{
+    uint64_t h = (uintptr_t)nw;
+    h = h * 0x9e3779b97f4a7c15 + (uintptr_t)ne;
+    h = h * 0x9e3779b97f4a7c15 + (uintptr_t)sw;
+    h = h * 0x9e3779b97f4a7c15 + (uintptr_t)se;
+    return (size_t)(h ^ (h >> 29));
+}
+
+void hl_rehash(size_t size)
+{
+    node_t **table = (node_t **)calloc(size, sizeof(node_t *));
+
+    for (size_t i = 0; i < hl_table_size; i++)
+    {
+        node_t *n = hl_table[i];
+        while (n)
+        {
+            node_t *next = n->next;
+            size_t h = hl_hash(n->nw, n->ne, n->sw, n->se) & (size - 1);
+            n->next = table[h];
+            table[h] = n;
+            n = next;
+        }
+    }
+
+    free(hl_table);
+    hl_table = table;
+    hl_table_size = size;
+}
+
+/* Returns the canonical node with the given quadrants */
+node_t *hl_join(node_t *nw, node_t *ne, node_t *sw, node_t *se)
+{
+    size_t h = hl_hash(nw, ne, sw, se) & (hl_table_size - 1);
+
+    for (node_t *n = hl_table[h]; n; n = n->next)
+        if (n->nw == nw && n->ne == ne && n->sw == sw && n->se == se)
+            return n;
+
+    if (!hl_free)
+    {
+        node_t *block = (node_t *)malloc(HL_BLOCK * sizeof(node_t));
+        for (int i = 0; i < HL_BLOCK; i++)
+        {
+            block[i].next = hl_free;
+            hl_free = &block[i];
         }
     }
 
+    node_t *n = hl_free;
+    hl_free = n->next;
+
+    n->nw = nw;
+    n->ne = ne;
+    n->sw = sw;
+    n->se = se;
+    n->result = NULL;
+    n->population =
+        nw->population + ne->population + sw->population + se->population;
+    n->level = nw->level + 1;
+    n->step = 0;
+    n->mark = 0;
+    n->next = hl_table[h];
+    hl_table[h] = n;
+
+    if (++hl_nodes > hl_table_size)
+        hl_rehash(hl_table_size * 2);
+
+    return n;
+}
+
+node_t *hl_empty(int level)
+{
+    if (!hl_empties[level])
+    {
+        node_t *e = hl_empty(level - 1);
+        hl_empties[level] = hl_join(e, e, e, e);
+    }
+
+    return hl_empties[level];
+}
+
+/* Surrounds the node with empty space, doubling its width */
+node_t *hl_expand(node_t *n)
+{
+    if (n->level >= HL_MAX_LEVEL)
+    {
+        fprintf(stderr, "[ERROR] HashLife universe exceeds level %d\n",
+            HL_MAX_LEVEL);
+        exit(1);
+    }
+
+    node_t *e = hl_empty(n->level - 1);
+
+    return hl_join(
+        hl_join(e, e, e, n->nw),
+        hl_join(e, e, n->ne, e),
+        hl_join(e, n->sw, e, e),
+        hl_join(n->se, e, e, e));
+}
+
+/* Center of a node, one level down */
+node_t *hl_center(node_t *n)
+{
+    return hl_join(n->nw->se, n->ne->sw, n->sw->ne, n->se->nw);
+}
+
+node_t *hl_center_h(node_t *w, node_t *e)
+{
+    return hl_join(w->ne, e->nw, w->se, e->sw);
+}
+
+node_t *hl_center_v(node_t *n, node_t *s)
+{
+    return hl_join(n->sw, n->se, s->nw, s->ne);
+}
+
+/* Advances the 2x2 center of a 4x4 node by one generation */
+node_t *hl_base(node_t *n)
+{
+    node_t *q[4][4] = {
+        { n->nw->nw, n->nw->ne, n->ne->nw, n->ne->ne },
+        { n->nw->sw, n->nw->se, n->ne->sw, n->ne->se },
+        { n->sw->nw, n->sw->ne, n->se->nw, n->se->ne },
+        { n->sw->sw, n->sw->se, n->se->sw, n->se->se }
+    };
+    node_t *c[2][2];
+
+    for (int y = 1; y < 3; y++)
+        for (int x = 1; x < 3; x++)
+        {
+            int count = 0;
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                    if (dx || dy)
+                        count += (int)q[y + dy][x + dx]->population;
+
+            cell_t next = { (int)q[y][x]->population };
+            transition(&next, count);
+            c[y - 1][x - 1] = &hl_leaves[next.state];
+        }
+
+    return hl_join(c[0][0], c[0][1], c[1][0], c[1][1]);
+}
+
+/*
+ * Returns the center of a node of level L >= 2, advanced 2^j generations,
+ * where j is capped at L - 2. The nine overlapping subnodes one level down
+ * are reduced to their centers, advanced when j allows it, then regrouped into
+ * four nodes which are advanced again.
+ */
+node_t *hl_successor(node_t *n, int j)
+{
+    int step = j < n->level - 2 ? j : n->level - 2;
+
+    if (n->result && n->step == step)
+        return n->result;
+
+    node_t *r;
+
+    if (n->level == 2)
+    {
+        r = hl_base(n);
+    }
+    else
+    {
+        node_t *s[3][3] = {
+            { n->nw, hl_center_h(n->nw, n->ne), n->ne },
+            { hl_center_v(n->nw, n->sw), hl_center(n),
+              hl_center_v(n->ne, n->se) },
+            { n->sw, hl_center_h(n->sw, n->se), n->se }
+        };
+
+        for (int y = 0; y < 3; y++)
+            for (int x = 0; x < 3; x++)
+                s[y][x] = step == n->level - 2
+                    ? hl_successor(s[y][x], j)
+                    : hl_center(s[y][x]);
+
+        r = hl_join(
+            hl_successor(hl_join(s[0][0], s[0][1], s[1][0], s[1][1]), j),
+            hl_successor(hl_join(s[0][1], s[0][2], s[1][1], s[1][2]), j),
+            hl_successor(hl_join(s[1][0], s[1][1], s[2][0], s[2][1]), j),
+            hl_successor(hl_join(s[1][1], s[1][2], s[2][1], s[2][2]), j));
+    }
+
+    n->result = r;
+    n->step = step;
+
+    return r;
+}
+
+node_t *hl_set(node_t *n, int64_t x, int64_t y, int s)
+{
+    if (n->level == 0)
+        return &hl_leaves[s];
+
+    int64_t half = (int64_t)1 << (n->level - 1);
+
+    if (y < half)
+    {
+        if (x < half)
+            return hl_join(hl_set(n->nw, x, y, s), n->ne, n->sw, n->se);
+        return hl_join(n->nw, hl_set(n->ne, x - half, y, s), n->sw, n->se);
+    }
+
+    if (x < half)
+        return hl_join(n->nw, n->ne, hl_set(n->sw, x, y - half, s), n->se);
+    return hl_join(n->nw, n->ne, n->sw, hl_set(n->se, x - half, y - half, s));
+}
+
+int hl_get(node_t *n, int64_t x, int64_t y)
+{
+    while (n->level > 0 && n->population > 0)
+    {
+        int64_t half = (int64_t)1 << (n->level - 1);
+        if (y < half)
+            n = x < half ? n->nw : n->ne;
+        else
+            n = x < half ? n->sw : n->se;
+        x &= half - 1;
+        y &= half - 1;
+    }
+
+    return n == &hl_leaves[ALIVE];
+}
+
+int hl_get_cell(int64_t x, int64_t y)
+{
+    int64_t half = (int64_t)1 << (hl_root->level - 1);
+
+    if (x < -half || x >= half || y < -half || y >= half)
+        return DEAD;
+
+    return hl_get(hl_root, x + half, y + half);
+}
+
+void hl_set_cell(int64_t x, int64_t y, int s)
+{
+    for (;;)
+    {
+        int64_t half = (int64_t)1 << (hl_root->level - 1);
+        if (x >= -half && x < half && y >= -half && y < half)
+            break;
+        hl_root = hl_expand(hl_root);
+    }
+
+    int64_t half = (int64_t)1 << (hl_root->level - 1);
+    hl_root = hl_set(hl_root, x + half, y + half, s);
+}
+
+/* Union of two nodes of the same level */
+node_t *hl_or(node_t *a, node_t *b)
+{
+    if (a->population == 0 || a == b)
+        return b;
+    if (b->population == 0)
+        return a;
+    if (a->level == 0)
+        return &hl_leaves[ALIVE];
+
+    return hl_join(hl_or(a->nw, b->nw), hl_or(a->ne, b->ne),
+        hl_or(a->sw, b->sw), hl_or(a->se, b->se));
+}
+
+/* Builds a node from a square of bits, one word per row */
+node_t *hl_block(uint64_t *rows, int level, int x, int y)
+{
+    if (level == 0)
+        return &hl_leaves[(rows[y] >> x) & 1];
+
+    int size = 1 << level;
+    uint64_t mask = size == 64
+        ? ~(uint64_t)0 : (((uint64_t)1 << size) - 1) << x;
+    uint64_t any = 0;
+    for (int i = y; i < y + size; i++)
+        any |= rows[i] & mask;
+    if (!any)
+        return hl_empty(level);
+
+    int half = size / 2;
+    return hl_join(
+        hl_block(rows, level - 1, x, y),
+        hl_block(rows, level - 1, x + half, y),
+        hl_block(rows, level - 1, x, y + half),
+        hl_block(rows, level - 1, x + half, y + half));
+}
+
+node_t *hl_place(node_t *n, int64_t x, int64_t y, node_t *b)
+{
+    if (n->level == b->level)
+        return hl_or(n, b);
+
+    int64_t half = (int64_t)1 << (n->level - 1);
+
+    if (y < half)
+    {
+        if (x < half)
+            return hl_join(hl_place(n->nw, x, y, b), n->ne, n->sw, n->se);
+        return hl_join(n->nw, hl_place(n->ne, x - half, y, b), n->sw, n->se);
+    }
+
+    if (x < half)
+        return hl_join(n->nw, n->ne, hl_place(n->sw, x, y - half, b), n->se);
+    return hl_join(n->nw, n->ne, n->sw, hl_place(n->se, x - half, y - half, b));
+}
+
+/* Adds the cells of a 64x64 block at (x, y), a multiple of 64 */
+void hl_add_block(int64_t x, int64_t y, uint64_t *rows)
+{
+    node_t *b = hl_block(rows, 6, 0, 0);
+
+    for (;;)
+    {
+        int64_t half = (int64_t)1 << (hl_root->level - 1);
+        if (hl_root->level > 6 && x >= -half && x + 64 <= half
+            && y >= -half && y + 64 <= half)
+            break;
+        hl_root = hl_expand(hl_root);
+    }
+
+    int64_t half = (int64_t)1 << (hl_root->level - 1);
+    hl_root = hl_place(hl_root, x + half, y + half, b);
+}
+
+void hl_mark(node_t *n)
+{
+    if (n->mark)
+        return;
+
+    n->mark = 1;
+    hl_mark(n->nw);
+    hl_mark(n->ne);
+    hl_mark(n->sw);
+    hl_mark(n->se);
+}
+
+/* Frees every node not reachable from the root, and results pointing to them */
+void hl_gc(void)
+{
+    hl_mark(hl_root);
+    for (int i = 1; i <= HL_MAX_LEVEL; i++)
+        if (hl_empties[i])
+            hl_mark(hl_empties[i]);
+
+    for (size_t i = 0; i < hl_table_size; i++)
+        for (node_t *n = hl_table[i]; n; n = n->next)
+            if (n->result && !n->result->mark)
+                n->result = NULL;
+
+    for (size_t i = 0; i < hl_table_size; i++)
+    {
+        node_t **link = &hl_table[i];
+        while (*link)
+        {
+            node_t *n = *link;
+            if (n->mark)
+            {
+                n->mark = 0;
+                link = &n->next;
+            }
+            else
+            {
+                *link = n->next;
+                n->next = hl_free;
+                hl_free = n;
+                hl_nodes--;
+            }
+        }
+    }
+}
+
+/* Drops the memoized results, which no longer hold once the rule changes */
+void hl_forget(void)
+{
+    for (size_t i = 0; i < hl_table_size; i++)
+        for (node_t *n = hl_table[i]; n; n = n->next)
+            n->result = NULL;
+}
+
+void hl_init(void)
+{
+    for (int s = 0; s < NUM_STATES; s++)
+        hl_leaves[s].nw = hl_leaves[s].ne =
+            hl_leaves[s].sw = hl_leaves[s].se = &hl_leaves[s];
+    hl_empties[0] = &hl_leaves[DEAD];
+
+    hl_rehash(1 << 16);
+    hl_root = hl_empty(3);
+}
+
+/*
+ * Advances the universe 2^j generations. The root is first padded until the
+ * pattern lies within its inner quarter and nothing can escape the result.
+ */
+void hl_advance(int j)
+{
+    if (hl_nodes > hl_max_nodes)
+        hl_gc();
+
+    while (hl_root->level < j + 2 || hl_root->population !=
+        hl_root->nw->se->se->population + hl_root->ne->sw->sw->population +
+        hl_root->sw->ne->ne->population + hl_root->se->nw->nw->population)
+        hl_root = hl_expand(hl_root);
+
+    hl_root = hl_successor(hl_expand(hl_root), j);
+    generation += (uint64_t)1 << j;
+}
+
+/* Jumps ahead n generations, one power of two at a time */
+void hl_jump(uint64_t n)
+{
+    for (int j = 63; j >= 0; j--)
+        if ((n >> j) & 1)
+            hl_advance(j);
+}
+
+void hl_render(node_t *n, int64_t x0, int64_t y0)
+{
+    int64_t size = (int64_t)1 << n->level;
+
+    if (n->population == 0
+        || x0 >= texture_w || y0 >= texture_h
+        || x0 + size <= 0 || y0 + size <= 0)
+        return;
+
+    if (n->level == 0)
+    {
+        pixel(x0, y0) = colors[ALIVE];
+        return;
+    }
+
+    int64_t half = size / 2;
+    hl_render(n->nw, x0, y0);
+    hl_render(n->ne, x0 + half, y0);
+    hl_render(n->sw, x0, y0 + half);
+    hl_render(n->se, x0 + half, y0 + half);
+}
+
+void render_hashlife(void)
+{
+    if (!pixels)
+        return;
+
+    for (size_t i = 0; i < (size_t)texture_w * texture_h; i++)
+        pixels[i] = colors[DEAD];
+    all_dirty = 1;
+
+    int64_t half = (int64_t)1 << (hl_root->level - 1);
+    hl_render(hl_root, -half, -half);
+}
+
+/*
+ * Sparse unbounded universe. Live cells are kept in 64x64 chunks of bits,
+ * found through a hash table keyed by chunk coordinates. Chunks are allocated
+ * when cells may be born in them and released once they are empty, so memory
+ * follows the population rather than the bounding box.
+ */
+typedef struct chunk {
+    int64_t cx, cy;
+    uint64_t rows[2][64];   /* Current and next generation, see sp_current */
+    struct chunk *next;     /* Hash chain */
+    int index;              /* Position in sp_chunks */
+} chunk_t;
+
+chunk_t **sp_table = NULL;
+size_t sp_table_size = 0;
+
+chunk_t **sp_chunks = NULL;
+int sp_num_chunks = 0;
+int sp_max_chunks = 0;
+
+int sp_current = 0;
+
+size_t sp_hash(int64_t cx, int64_t cy)
+{
+    uint64_t h = (uint64_t)cx * 0x9e3779b97f4a7c15 ^ (uint64_t)cy;
+    h *= 0xbf58476d1ce4e5b9;
+    return (size_t)(h ^ (h >> 31));
+}
+
+chunk_t *sp_find(int64_t cx, int64_t cy)
+{
+    chunk_t *c = sp_table[sp_hash(cx, cy) & (sp_table_size - 1)];
+
+    while (c && (c->cx != cx || c->cy != cy))
+        c = c->next;
+
+    return c;
+}
+
+void sp_rehash(size_t size)
+{
+    chunk_t **table = (chunk_t **)calloc(size, sizeof(chunk_t *));
+
+    for (int i = 0; i < sp_num_chunks; i++)
+    {
+        chunk_t *c = sp_chunks[i];
+        size_t h = sp_hash(c->cx, c->cy) & (size - 1);
+        c->next = table[h];
+        table[h] = c;
+    }
+
+    free(sp_table);
+    sp_table = table;
+    sp_table_size = size;
+}
+
+chunk_t *sp_get(int64_t cx, int64_t cy)
+{
+    chunk_t *c = sp_find(cx, cy);
+
+    if (c)
+        return c;
+
+    if (sp_num_chunks == sp_max_chunks)
+    {
+        sp_max_chunks = sp_max_chunks ? sp_max_chunks * 2 : 1024;
+        sp_chunks = (chunk_t **)realloc(sp_chunks,
+            sp_max_chunks * sizeof(chunk_t *));
+    }
+
+    c = (chunk_t *)calloc(1, sizeof(chunk_t));
+    c->cx = cx;
+    c->cy = cy;
+    c->index = sp_num_chunks;
+    sp_chunks[sp_num_chunks++] = c;
+
+    if ((size_t)sp_num_chunks > sp_table_size)
+    {
+        sp_rehash(sp_table_size * 2);
+    }
+    else
+    {
+        size_t h = sp_hash(cx, cy) & (sp_table_size - 1);
+        c->next = sp_table[h];
+        sp_table[h] = c;
+    }
+
+    return c;
+}
+
+void sp_release(chunk_t *c)
+{
+    chunk_t **link = &sp_table[sp_hash(c->cx, c->cy) & (sp_table_size - 1)];
+    while (*link != c)
+        link = &(*link)->next;
+    *link = c->next;
+
+    chunk_t *last = sp_chunks[--sp_num_chunks];
+    sp_chunks[c->index] = last;
+    last->index = c->index;
+
+    free(c);
+}
+
+void sp_set_cell(int64_t x, int64_t y, int s)
+{
+    chunk_t *c = sp_get(x >> 6, y >> 6);
+    uint64_t mask = (uint64_t)1 << (x & 63);
+
+    if (s)
+        c->rows[sp_current][y & 63] |= mask;
+    else
+        c->rows[sp_current][y & 63] &= ~mask;
+}
+
+int sp_get_cell(int64_t x, int64_t y)
+{
+    chunk_t *c = sp_find(x >> 6, y >> 6);
+
+    return c ? (int)((c->rows[sp_current][y & 63] >> (x & 63)) & 1) : DEAD;
+}
+
+/* Makes sure chunks exist wherever cells next to the edges can give births */
+void sp_grow(void)
+{
+    int n = sp_num_chunks;
+
+    for (int i = 0; i < n; i++)
+    {
+        chunk_t *c = sp_chunks[i];
+        uint64_t *rows = c->rows[sp_current];
+        uint64_t all = 0;
+
+        for (int y = 0; y < 64; y++)
+            all |= rows[y];
+        if (!all)
+            continue;
+
+        int north = rows[0] != 0;
+        int south = rows[63] != 0;
+        int west = (all & 1) != 0;
+        int east = (all >> 63) != 0;
+
+        if (north)
+            sp_get(c->cx, c->cy - 1);
+        if (south)
+            sp_get(c->cx, c->cy + 1);
+        if (west)
+            sp_get(c->cx - 1, c->cy);
+        if (east)
+            sp_get(c->cx + 1, c->cy);
+        if (rows[0] & 1)
+            sp_get(c->cx - 1, c->cy - 1);
+        if (rows[0] >> 63)
+            sp_get(c->cx + 1, c->cy - 1);
+        if (rows[63] & 1)
+            sp_get(c->cx - 1, c->cy + 1);
+        if (rows[63] >> 63)
+            sp_get(c->cx + 1, c->cy + 1);
+    }
+}
+
+/* Row y, from -1 to 64, of the 3x3 chunks around a chunk */
+void sp_row(chunk_t *nb[3][3], int y, uint64_t *w, uint64_t *c, uint64_t *e)
+{
+    int j = 1;
+
+    if (y < 0)
+    {
+        j = 0;
+        y = 63;
+    }
+    else if (y > 63)
+    {
+        j = 2;
+        y = 0;
+    }
+
+    uint64_t west = nb[j][0] ? nb[j][0]->rows[sp_current][y] : 0;
+    uint64_t mid = nb[j][1] ? nb[j][1]->rows[sp_current][y] : 0;
+    uint64_t east = nb[j][2] ? nb[j][2]->rows[sp_current][y] : 0;
+
+    *w = (mid << 1) | (west >> 63);
+    *c = mid;
+    *e = (mid >> 1) | (east << 63);
+}
+
+/* Returns whether the chunk has any live cells in the next generation */
+int sp_evaluate_chunk(chunk_t *chunk)
+{
+    chunk_t *nb[3][3];
+    uint64_t *next = chunk->rows[!sp_current];
+    uint64_t any = 0;
+
+    for (int j = 0; j < 3; j++)
+        for (int i = 0; i < 3; i++)
+            nb[j][i] = sp_find(chunk->cx + i - 1, chunk->cy + j - 1);
+
+    uint64_t nw, n, ne, w, c, e, sw, s, se;
+    sp_row(nb, -1, &nw, &n, &ne);
+    sp_row(nb, 0, &w, &c, &e);
+
+    for (int y = 0; y < 64; y++)
+    {
+        sp_row(nb, y + 1, &sw, &s, &se);
+        next[y] = next_word(nw, n, ne, w, c, e, sw, s, se);
+        any |= next[y];
+
+        nw = w; n = c; ne = e;
+        w = sw; c = s; e = se;
+    }
+
+    return any != 0;
+}
+
+void sp_step(void)
+{
+    sp_grow();
+
+    int n = sp_num_chunks;
+    uint8_t *alive = (uint8_t *)malloc(n > 0 ? n : 1);
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int i = 0; i < n; i++)
+        alive[i] = sp_evaluate_chunk(sp_chunks[i]);
+
+    sp_current = !sp_current;
+
+    /* Backwards, so that swapping in the last chunk keeps the indices valid */
+    for (int i = n - 1; i >= 0; i--)
+        if (!alive[i])
+            sp_release(sp_chunks[i]);
+
+    free(alive);
+    generation++;
+}
+
+void sp_init(void)
+{
+    sp_rehash(1024);
+}
+
+void render_sparse(void)
+{
+    if (!pixels)
+        return;
+
+    for (size_t i = 0; i < (size_t)texture_w * texture_h; i++)
+        pixels[i] = colors[DEAD];
+    all_dirty = 1;
+
+    for (int i = 0; i < sp_num_chunks; i++)
+    {
+        chunk_t *c = sp_chunks[i];
+        int64_t x0 = c->cx * 64;
+        int64_t y0 = c->cy * 64;
+
+        if (x0 >= texture_w || y0 >= texture_h || x0 + 64 <= 0 || y0 + 64 <= 0)
+            continue;
+
+        for (int y = 0; y < 64; y++)
+        {
+            uint64_t row = c->rows[sp_current][y];
+            while (row)
+            {
+                int b = __builtin_ctzll(row);
+                if (y0 + y >= 0 && y0 + y < texture_h
+                    && x0 + b >= 0 && x0 + b < texture_w)
+                    pixel(x0 + b, y0 + y) = colors[ALIVE];
+                row &= row - 1;
+            }
+        }
+    }
+}
+
+void seed_cell_grid(void)
+{
+    int dx = texture_w / 4;
+    int dy = texture_h / 4;
+    int xbound[2] = { dx, texture_w - dx };
+    int ybound[2] = { dy, texture_h - dy };
+
+    for (int y = ybound[0]; y < ybound[1]; y++)
+        for (int x = xbound[0]; x < xbound[1]; x++)
+            set_cell_state(x, y, ALIVE);
+}
+
+double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Pattern loading, RLE and Life 1.06. Files are read through a small buffer
+ * and cells are handed to the engine while parsing, so neither the file nor
+ * the pattern is ever held in memory as a whole.
+ */
+typedef struct {
+    FILE *file;
+    size_t size;
+    size_t pos;
+    char buffer[1 << 16];
+} reader_t;
+
+int read_char(reader_t *r)
+{
+    if (r->pos == r->size)
+    {
+        r->size = fread(r->buffer, 1, sizeof(r->buffer), r->file);
+        r->pos = 0;
+        if (r->size == 0)
+            return EOF;
+    }
+
+    return (unsigned char)r->buffer[r->pos++];
+}
+
+/* Reads the rest of the line into 'line', truncating it if needed */
+int read_line(reader_t *r, char *line, int size)
+{
+    int c, n = 0;
+
+    while ((c = read_char(r)) != EOF && c != '\n')
+        if (n < size - 1)
+            line[n++] = c;
+    line[n] = '\0';
+
+    return c == EOF && n == 0 ? EOF : n;
+}
+
+/*
+ * HashLife gets loaded cells in 64x64 blocks, gathered for one band of 64 rows
+ * at a time. RLE patterns arrive row by row, so each band is only flushed
+ * once.
+ */
+typedef struct {
+    int64_t bx;
+    uint64_t rows[64];
+} block_t;
+
+block_t *load_blocks = NULL;
+int load_num_blocks = 0;
+int load_max_blocks = 0;
+int64_t load_band = INT64_MIN;
+
+void flush_blocks(void)
+{
+    for (int i = 0; i < load_num_blocks; i++)
+        hl_add_block(load_blocks[i].bx * 64, load_band * 64,
+            load_blocks[i].rows);
+
+    load_num_blocks = 0;
+}
+
+block_t *find_block(int64_t bx, int64_t band)
+{
+    if (band != load_band)
+    {
+        flush_blocks();
+        load_band = band;
+    }
+
+    /* Runs mostly extend the block touched last */
+    for (int i = load_num_blocks - 1; i >= 0; i--)
+        if (load_blocks[i].bx == bx)
+            return &load_blocks[i];
+
+    if (load_num_blocks == load_max_blocks)
+    {
+        load_max_blocks = load_max_blocks ? load_max_blocks * 2 : 64;
+        load_blocks = (block_t *)realloc(load_blocks,
+            load_max_blocks * sizeof(block_t));
+    }
+
+    block_t *b = &load_blocks[load_num_blocks++];
+    b->bx = bx;
+    memset(b->rows, 0, sizeof(b->rows));
+
+    return b;
+}
+
+uint64_t loaded_cells = 0;
+
+/* Sets n cells alive from (x, y) eastwards */
+void load_run(int64_t x, int64_t y, int64_t n)
+{
+    loaded_cells += n;
+
+    if (engine == ENGINE_HASHLIFE)
+    {
+        while (n > 0)
+        {
+            int64_t bx = x >> 6;
+            int bit = x & 63;
+            int len = n < 64 - bit ? (int)n : 64 - bit;
+            block_t *b = find_block(bx, y >> 6);
+            uint64_t mask = len == 64 ? ~(uint64_t)0
+                : (((uint64_t)1 << len) - 1) << bit;
+            b->rows[y & 63] |= mask;
+            x += len;
+            n -= len;
+        }
+        return;
+    }
+
+    if (engine == ENGINE_SPARSE)
+    {
+        for (int64_t i = 0; i < n; i++)
+            sp_set_cell(x + i, y, ALIVE);
+        return;
+    }
+
+    /* The grid engines clip the pattern to the grid */
+    if (y < 0 || y >= texture_h)
+        return;
+    int64_t x0 = x < 0 ? 0 : x;
+    int64_t x1 = x + n < texture_w ? x + n : texture_w;
+
+    for (int64_t i = x0; i < x1; i++)
+        set_cell_state((int)i, (int)y, ALIVE);
+}
+
+/* Body of an RLE file: runs of 'b' (dead) and 'o' (alive), '$' ends a row */
+void load_rle(reader_t *r, int64_t ox, int64_t oy)
+{
+    int64_t x = 0, y = 0, n = 0;
+    int c;
+
+    while ((c = read_char(r)) != EOF && c != '!')
+    {
+        if (c >= '0' && c <= '9')
+        {
+            n = n * 10 + (c - '0');
+            continue;
+        }
+
+        int64_t count = n > 0 ? n : 1;
+        n = 0;
+
+        if (c == '$')
+        {
+            y += count;
+            x = 0;
+        }
+        else if (c == 'b' || c == '.')
+        {
+            x += count;
+        }
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        {
+            /* Other states of multi-state patterns count as alive */
+            load_run(ox + x, oy + y, count);
+            x += count;
+        }
+    }
+}
+
+void load_life106(reader_t *r, int64_t ox, int64_t oy)
+{
+    char line[256];
+
+    while (read_line(r, line, sizeof(line)) != EOF)
+    {
+        long long x, y;
+        if (line[0] != '#' && sscanf(line, "%lld %lld", &x, &y) == 2)
+            load_run(ox + x, oy + y, 1);
+    }
+}
+
+/* Switches to the rule of a pattern file, unless one was given with -r */
+void load_rule(char *str)
+{
+    int births, survivals;
+
+    if (parse_rule(str, &births, &survivals) == -1)
+    {
+        fprintf(stderr, "[WARNING] Ignoring unsupported pattern rule %s\n",
+            str);
+        return;
+    }
+
+    if (births == rule_births && survivals == rule_survivals)
+        return;
+
+    if (rule_fixed)
+    {
+        fprintf(stderr, "[WARNING] Ignoring pattern rule, running %s\n",
+            rule_name);
+        return;
+    }
+
+    if ((births & 1) && engine >= ENGINE_HASHLIFE)
+    {
+        fprintf(stderr, "[WARNING] Ignoring pattern rule, B0 rules need a"
+            " bounded engine\n");
+        return;
+    }
+
+    set_rule(births, survivals);
+    hl_forget();
+    fprintf(stderr, "Switched to rule %s\n", rule_name);
+}
+
+/*
+ * Loads a pattern on top of the current grid. RLE patterns are centered on
+ * the grid, Life 1.06 patterns have their origin at the center of the grid.
+ */
+int load_pattern(const char *path)
+{
+    reader_t *r = (reader_t *)malloc(sizeof(reader_t));
+    r->file = fopen(path, "rb");
+    r->size = r->pos = 0;
+
+    if (!r->file)
+    {
+        fprintf(stderr, "[ERROR] Could not open '%s'\n", path);
+        free(r);
+        return -1;
+    }
+
+    double start = wall_time();
+    loaded_cells = 0;
+
+    char line[1024];
+    int c;
+    int64_t ox = texture_w / 2;
+    int64_t oy = texture_h / 2;
+
+    /* Comments and header, up to the first line of the body */
+    while ((c = read_char(r)) != EOF)
+    {
+        if (c == '#')
+        {
+            read_line(r, line, sizeof(line));
+            if (strncmp(line, "Life 1.06", 9) == 0)
+            {
+                load_life106(r, ox, oy);
+                break;
+            }
+        }
+        else if (c == 'x')
+        {
+            long long w = 0, h = 0;
+            read_line(r, line, sizeof(line));
+            sscanf(line, " = %lld , y = %lld", &w, &h);
+            char *rule = strstr(line, "rule");
+            if (rule && (rule = strchr(rule, '=')))
+                load_rule(rule + 1 + strspn(rule + 1, " \t"));
+            load_rle(r, ox - w / 2, oy - h / 2);
+            break;
+        }
+        else if (c != '\n' && c != '\r' && c != ' ' && c != '\t')
+        {
+            /* RLE without a header line */
+            r->pos--;
+            load_rle(r, ox, oy);
+            break;
+        }
+    }
+
+    if (engine == ENGINE_HASHLIFE)
+    {
+        flush_blocks();
+        load_band = INT64_MIN;
+    }
+
+    fclose(r->file);
+    free(r);
+
+    fprintf(stderr, "Loaded %llu cells from '%s' in %.3f s\n",
+        (unsigned long long)loaded_cells, path, wall_time() - start);
+
+    return 0;
+}
+
+/*
+ * Bytes of one grid of a w x h grid file, in whole pages, or 0 if the size is
+ * invalid or the file would not fit in memory
+ */
+size_t grid_file_bytes(int w, int h)
+{
+    if (w < 1 || h < 1)
+        return 0;
+
+    uint64_t row = engine == ENGINE_BITS
+        ? (uint64_t)(w + 63) / 64 * sizeof(uint64_t)
+        : (uint64_t)w * sizeof(cell_t);
+    if (row > ((SIZE_MAX - GRID_PAGE) / 4 - GRID_PAGE) / h)
+        return 0;
+
+    return (row * h + GRID_PAGE - 1) / GRID_PAGE * GRID_PAGE;
+}
+
+/*
+ * Maps the grid file, creating it if needed. Returns 1 if the grid was restored
+ * from an existing file, in which case its size, generation and rule replace
+ * the ones given on the command line, 0 for a new file and -1 on errors. A new
+ * file only gets its magic with its first checkpoint, see checkpoint().
+ */
+int open_grid_file(const char *path, int *births, int *survivals)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "[ERROR] Could not open '%s'\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    grid_header_t header;
+    int restored = fstat(fd, &st) == 0 && st.st_size > 0;
+    int width = texture_w;
+    int height = texture_h;
+
+    if (restored)
+    {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, GRID_MAGIC, sizeof(header.magic)) != 0
+            || header.version != GRID_VERSION)
+        {
+            fprintf(stderr, "[ERROR] '%s' is not a grid file\n", path);
+            close(fd);
+            return -1;
+        }
+        if (header.engine != (uint32_t)engine)
+        {
+            fprintf(stderr, "[ERROR] '%s' holds a grid of the '%s' engine\n",
+                path, engine_names[header.engine < NUM_ENGINES
+                    ? header.engine : ENGINE_BITS]);
+            close(fd);
+            return -1;
+        }
+        width = header.width;
+        height = header.height;
+    }
+
+    /* The header is only trusted once the file has the size it implies */
+    grid_bytes = grid_file_bytes(width, height);
+    grid_map_size = GRID_PAGE + 4 * grid_bytes;
+
+    if (grid_bytes == 0 || (restored ? (size_t)st.st_size != grid_map_size
+        : ftruncate(fd, grid_map_size) == -1))
+    {
+        fprintf(stderr, "[ERROR] '%s' does not have the expected size\n", path);
+        close(fd);
+        return -1;
+    }
+
+    texture_w = width;
+    texture_h = height;
+    words_w = (texture_w + 63) / 64;
+    if (restored && !rule_fixed)
+    {
+        *births = header.births;
+        *survivals = header.survivals;
+    }
+
+    grid_map = (uint8_t *)mmap(NULL, grid_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (grid_map == MAP_FAILED)
+    {
+        fprintf(stderr, "[ERROR] Could not map '%s'\n", path);
+        return -1;
+    }
+
+    grid_header = (grid_header_t *)grid_map;
+    for (int k = 0; k < 2; k++)
+        grid_slots[k] = grid_map + GRID_PAGE + (2 + k) * grid_bytes;
+
+    if (restored)
+    {
+        generation = header.generation;
+        memcpy(grid_map + GRID_PAGE, grid_slots[header.slot & 1], grid_bytes);
+        fprintf(stderr, "Restored generation %llu from '%s'\n",
+            (unsigned long long)generation, path);
+    }
+    else
+    {
+        grid_header->version = GRID_VERSION;
+        grid_header->engine = engine;
+        grid_header->width = texture_w;
+        grid_header->height = texture_h;
+    }
+
+    return restored;
+}
+
+/* Saves the grid into the older checkpoint slot and syncs it to disk */
+void checkpoint(void)
+{
+    uint8_t *grid = engine == ENGINE_BITS
+        ? (uint8_t *)bit_grid_a : (uint8_t *)cell_grid_a;
+    int k = !grid_header->slot;
+    uint8_t *slot = grid_slots[k];
+
+    for (int t = 0; t < tiles_w * tiles_h; t++)
+    {
+        if (!(tile_unsaved[t] & (1 << k)))
+            continue;
+
+        int tx = t % tiles_w;
+        int ty = t / tiles_w;
+        int y1 = (ty + 1) * TILE_H < texture_h ? (ty + 1) * TILE_H : texture_h;
+
+        for (int y = ty * TILE_H; y < y1; y++)
+        {
+            size_t offset, length;
+            if (engine == ENGINE_BITS)
+            {
+                offset = ((size_t)words_w * y + tx) * sizeof(uint64_t);
+                length = sizeof(uint64_t);
+            }
+            else
+            {
+                int x1 = (tx + 1) * TILE_W < texture_w
+                    ? (tx + 1) * TILE_W : texture_w;
+                offset = ((size_t)texture_w * y + tx * TILE_W) * sizeof(cell_t);
+                length = (size_t)(x1 - tx * TILE_W) * sizeof(cell_t);
+            }
+            memcpy(slot + offset, grid + offset, length);
+        }
+
+        tile_unsaved[t] &= ~(1 << k);
+    }
+
+    /* The slot must be on disk before the header points to it */
+    msync(slot, grid_bytes, MS_SYNC);
+
+    grid_header->generation = generation;
+    grid_header->slot = k;
+    grid_header->births = rule_births;
+    grid_header->survivals = rule_survivals;
+
+    /* Until its first checkpoint, a new file does not hold a grid */
+    memcpy(grid_header->magic, GRID_MAGIC, sizeof(grid_header->magic));
+    msync(grid_map, GRID_PAGE, MS_SYNC);
+}
+
+/* Looks the current generation up in the history, then records it */
+void check_cycle(void)
+{
+    if (cycle_period)
+        return;
+
+    history_t *h = &history[grid_hash & (HISTORY_SIZE - 1)];
+
+    if (h->seen && h->hash == grid_hash)
+    {
+        cycle_start = h->seen - 1;
+        cycle_period = generation - cycle_start;
+        if (detect_cycles == CYCLES_QUIET)
+            return;
+        fprintf(stderr, "Cycle of period %llu from generation %llu\n",
+            (unsigned long long)cycle_period,
+            (unsigned long long)cycle_start);
+        return;
+    }
+
+    h->hash = grid_hash;
+    h->seen = generation + 1;
+}
+
+void step(void)
+{
+    switch (engine)
+    {
+    case ENGINE_SCALAR:
+        evaluate_cell_grid();
+        break;
+    case ENGINE_BITS:
+        evaluate_bit_grid();
+        break;
+    case ENGINE_HASHLIFE:
+        hl_advance(hl_step_log);
+        break;
+    case ENGINE_SPARSE:
+        sp_step();
+        break;
+    }
+
+    if (detect_cycles)
+        check_cycle();
+
+    if (grid_map && checkpoint_interval
+        && generation % checkpoint_interval == 0)
+        checkpoint();
+}
+
+int cell_state(int x, int y)
+{
+    switch (engine)
+    {
+    case ENGINE_BITS:
+        return bit_a(x, y);
+    case ENGINE_HASHLIFE:
+        return hl_get_cell(x, y);
+    case ENGINE_SPARSE:
+        return sp_get_cell(x, y);
+    }
+
+    return grid_a(x, y).state;
+}
+
+/* Hashes the grid from scratch and forgets the past generations */
+void reset_cycles(void)
+{
+    if (!detect_cycles)
+        return;
+
+    if (!history)
+        history = (history_t *)malloc(HISTORY_SIZE * sizeof(history_t));
+    memset(history, 0, HISTORY_SIZE * sizeof(history_t));
+    cycle_period = 0;
+
+    grid_hash = 0;
+    for (int y = 0; y < texture_h; y++)
+        for (int x = 0; x < texture_w; x++)
+            if (cell_state(x, y))
+                grid_hash ^= zobrist(x, y);
+
+    history[grid_hash & (HISTORY_SIZE - 1)] =
+        (history_t){ grid_hash, generation + 1 };
+}
+
+/* The grid engines keep the pixels up to date as they step */
+void render(void)
+{
+    if (engine == ENGINE_HASHLIFE)
+        render_hashlife();
+    else if (engine == ENGINE_SPARSE)
+        render_sparse();
+}
+
+/* Advances the grid to generation n before anything is shown */
+void jump(uint64_t n)
+{
+    if (engine == ENGINE_HASHLIFE)
+    {
+        hl_jump(n - generation);
+        return;
+    }
+
+    while (generation < n && !(detect_cycles == CYCLES_STOP && cycle_period))
+        step();
+}
+
+/*
+ * Worker processes. The grid is split into slabs of whole tile rows, one per
+ * forked worker. Each worker steps its slab in its own copy-on-write view of
+ * the grid, so it only ever touches its rows and the two halo rows around
+ * them. Every generation, workers publish their first and last rows to shared
+ * memory, wait on a process-shared barrier, and copy the rows of their
+ * neighbors into their halo. The halo slots are double-buffered by
+ * generation parity: a worker can only overwrite a slot two generations
+ * later, after its neighbors passed the next barrier and so finished reading
+ * it. Once done, workers copy their slab into a shared result grid.
+ */
+int workers = 1;
+double workers_cpu_s = 0;
+
+typedef struct {
+    pthread_barrier_t barrier;
+} shared_t;
+
+shared_t *shared = NULL;
+uint8_t *halos = NULL;  /* [parity][worker][first, last row] */
+uint8_t *result = NULL;
+
+size_t row_bytes(void)
+{
+    return engine == ENGINE_BITS
+        ? words_w * sizeof(uint64_t) : texture_w * sizeof(cell_t);
+}
+
+uint8_t *grid_row(int y)
+{
+    return engine == ENGINE_BITS
+        ? (uint8_t *)&bits_a(0, y) : (uint8_t *)&grid_a(0, y);
+}
+
+uint8_t *halo(int parity, int worker, int last)
+{
+    return halos
+        + ((size_t)(parity * workers + worker) * 2 + last) * row_bytes();
+}
+
+/* First row of the slab of worker i, in whole tiles */
+int slab_start(int i)
+{
+    int y = (int)((int64_t)tiles_h * i / workers) * TILE_H;
+    return y < texture_h ? y : texture_h;
+}
+
+void run_worker(int i, uint64_t n)
+{
+    int y0 = slab_start(i);
+    int y1 = slab_start(i + 1);
+    size_t bytes = row_bytes();
+
+    for (uint64_t g = 0; g < n; g++)
+    {
+        int parity = g & 1;
+
+        memcpy(halo(parity, i, 0), grid_row(y0), bytes);
+        memcpy(halo(parity, i, 1), grid_row(y1 - 1), bytes);
+        pthread_barrier_wait(&shared->barrier);
+        if (i > 0)
+            memcpy(grid_row(y0 - 1), halo(parity, i - 1, 1), bytes);
+        if (i < workers - 1)
+            memcpy(grid_row(y1), halo(parity, i + 1, 0), bytes);
+
+        for (int ty = y0 / TILE_H; ty * TILE_H < y1; ty++)
+            for (int tx = 0; tx < tiles_w; tx++)
+            {
+                if (engine == ENGINE_BITS)
+                    evaluate_bit_tile(tx, ty);
+                else
+                    evaluate_cell_tile(tx, ty);
+            }
+
+        if (engine == ENGINE_BITS)
+            swap_bits(&bit_grid_a, &bit_grid_b);
+        else
+            swap(&cell_grid_a, &cell_grid_b);
+    }
+
+    for (int y = y0; y < y1; y++)
+        memcpy(result + (size_t)y * bytes, grid_row(y), bytes);
+}
+
+/* Kills the workers not reaped yet, those with a pid */
+void kill_workers(pid_t *pids, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (pids[i] > 0)
+            kill(pids[i], SIGKILL);
+}
+
+/* Steps n generations with the worker processes, returns -1 if one failed */
+int step_workers(uint64_t n)
+{
+    /* Every worker needs at least one tile row */
+    if (workers > tiles_h)
+        workers = tiles_h;
+
+    size_t bytes = row_bytes();
+    size_t size = sizeof(shared_t) + 4 * workers * bytes
+        + (size_t)texture_h * bytes;
+
+    uint8_t *map = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "[ERROR] Could not map shared memory\n");
+        return -1;
+    }
+
+    shared = (shared_t *)map;
+    halos = map + sizeof(shared_t);
+    result = halos + 4 * workers * bytes;
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shared->barrier, &attr, workers);
+    pthread_barrierattr_destroy(&attr);
+
+    struct rusage before, after;
+    getrusage(RUSAGE_CHILDREN, &before);
+
+    pid_t *pids = (pid_t *)malloc(workers * sizeof(pid_t));
+    int forked = 0;
+    int failed = 0;
+
+    fflush(NULL);
+    for (; forked < workers; forked++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            run_worker(forked, n);
+            _exit(0);
+        }
+        if (pid == -1)
+        {
+            /* The barrier can never be reached, stop the others */
+            fprintf(stderr, "[ERROR] Could not fork worker %d\n", forked);
+            kill_workers(pids, forked);
+            failed = 1;
+            break;
+        }
+        pids[forked] = pid;
+    }
+
+    /*
+     * The other workers would wait forever at the barrier for one that died,
+     * so the first to fail brings them all down
+     */
+    for (int left = forked; left > 0; )
+    {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            failed = 1;
+            break;
+        }
+
+        for (int i = 0; i < forked; i++)
+            if (pids[i] == pid)
+                pids[i] = 0;
+        left--;
+
+        if (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        {
+            kill_workers(pids, forked);
+            failed = 1;
+        }
+    }
+    free(pids);
+
+    getrusage(RUSAGE_CHILDREN, &after);
+    workers_cpu_s += after.ru_utime.tv_sec - before.ru_utime.tv_sec
+        + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) * 1e-6
+        + after.ru_stime.tv_sec - before.ru_stime.tv_sec
+        + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) * 1e-6;
+
+    if (!failed)
+    {
+        for (int y = 0; y < texture_h; y++)
+            memcpy(grid_row(y), result + (size_t)y * bytes, bytes);
+        generation += n;
+    }
+    else
+    {
+        fprintf(stderr, "[ERROR] A worker failed\n");
+    }
+
+    pthread_barrier_destroy(&shared->barrier);
+    munmap(map, size);
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Soup ensembles. With -S, random soups are run to stabilization or to a
+ * generation cap by forked workers, each taking every workers-th soup. A soup
+ * fills the middle of the grid at density 1/2 from a generator seeded with
+ * the seed plus its number, so results do not depend on the worker count.
+ * Once a soup stops, its objects (groups of alive cells touching each other)
+ * are put in a canonical orientation and counted. Workers send one record per
+ * soup, then their census, to the parent through a pipe. Records are smaller
+ * than PIPE_BUF, so the writes of different workers do not interleave.
+ */
+#define SOUP_GENERATIONS 10000  /* Default cap */
+#define CURVE_POINTS 64         /* Population samples per soup */
+#define CENSUS_SIDE 16          /* Larger objects are counted as "large" */
+#define CENSUS_SIZE 4096        /* Distinct objects, others count as "other" */
+
+uint64_t soups = 0;
+
+typedef struct {
+    uint8_t w, h;   /* 0 for large objects, 0xff for the overflow entry */
+    uint16_t rows[CENSUS_SIDE];
+} object_t;
+
+typedef struct {
+    object_t object;
+    uint64_t count;
+} census_t;
+
+enum {
+    RECORD_SOUP,
+    RECORD_OBJECT
+};
+
+typedef struct {
+    int type;
+    uint64_t lifespan;  /* First generation of the final cycle, or the cap */
+    uint64_t period;    /* 0 if the soup did not stabilize */
+    uint32_t curve[CURVE_POINTS];
+    census_t census;
+} record_t;
+
+census_t *census = NULL;
+size_t census_used = 0;
+
+size_t census_hash(const object_t *o)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < sizeof(object_t); i++)
+        h = (h ^ ((const uint8_t *)o)[i]) * 0x100000001b3;
+    return h & (CENSUS_SIZE - 1);
+}
+
+void census_add(const object_t *o, uint64_t count)
+{
+    static const object_t other = { 0xff, 0xff, { 0 } };
+
+    size_t i = census_hash(o);
+    for (int n = 0; n < CENSUS_SIZE; n++, i = (i + 1) & (CENSUS_SIZE - 1))
+    {
+        if (census[i].count && memcmp(&census[i].object, o, sizeof(object_t)))
+            continue;
+
+        if (!census[i].count)
+        {
+            /* The last free entry is kept for the overflow */
+            if (census_used == CENSUS_SIZE - 1
+                && memcmp(o, &other, sizeof(object_t)))
+                break;
+            census[i].object = *o;
+            census_used++;
+        }
+        census[i].count += count;
+        return;
+    }
+
+    census_add(&other, count);
+}
+
+/*
+ * Counts the object made of the n cells in xs, ys, in the smallest of its
+ * eight orientations
+ */
+void census_object(int *xs, int *ys, int n)
+{
+    int x0 = texture_w, y0 = texture_h, x1 = 0, y1 = 0;
+    for (int i = 0; i < n; i++)
+    {
+        x0 = xs[i] < x0 ? xs[i] : x0;
+        y0 = ys[i] < y0 ? ys[i] : y0;
+        x1 = xs[i] > x1 ? xs[i] : x1;
+        y1 = ys[i] > y1 ? ys[i] : y1;
+    }
+
+    int w = x1 - x0 + 1;
+    int h = y1 - y0 + 1;
+    object_t best;
+    memset(&best, 0, sizeof(best));
+
+    if (w > CENSUS_SIDE || h > CENSUS_SIDE)
+    {
+        census_add(&best, 1);
+        return;
+    }
+
+    for (int t = 0; t < 8; t++)
+    {
+        object_t o;
+        memset(&o, 0, sizeof(o));
+        o.w = t & 4 ? h : w;
+        o.h = t & 4 ? w : h;
+
+        for (int i = 0; i < n; i++)
+        {
+            int x = xs[i] - x0;
+            int y = ys[i] - y0;
+            if (t & 1)
+                x = w - 1 - x;
+            if (t & 2)
+                y = h - 1 - y;
+            if (t & 4)
+                o.rows[x] |= 1 << y;
+            else
+                o.rows[y] |= 1 << x;
+        }
+
+        if (t == 0 || memcmp(&o, &best, sizeof(o)) < 0)
+            best = o;
+    }
+
+    census_add(&best, 1);
+}
+
+/* Splits the alive cells into objects and counts them */
+void census_grid(void)
+{
+    size_t cells = (size_t)texture_w * texture_h;
+    uint8_t *seen = (uint8_t *)calloc(cells, 1);
+    int *xs = (int *)malloc(cells * sizeof(int));
+    int *ys = (int *)malloc(cells * sizeof(int));
+
+    for (int y = 0; y < texture_h; y++)
+        for (int x = 0; x < texture_w; x++)
+        {
+            if (seen[(size_t)texture_w * y + x] || !cell_state(x, y))
+                continue;
+
+            /* Flood fill, the cells found so far double as the stack */
+            int n = 0;
+            seen[(size_t)texture_w * y + x] = 1;
+            xs[n] = x;
+            ys[n++] = y;
+            for (int i = 0; i < n; i++)
+                for (int ny = ys[i] - 1; ny <= ys[i] + 1; ny++)
+                    for (int nx = xs[i] - 1; nx <= xs[i] + 1; nx++)
+                    {
+                        if (nx < 0 || ny < 0 || nx >= texture_w
+                            || ny >= texture_h)
+                            continue;
+                        size_t c = (size_t)texture_w * ny + nx;
+                        if (seen[c] || !cell_state(nx, ny))
+                            continue;
+                        seen[c] = 1;
+                        xs[n] = nx;
+                        ys[n++] = ny;
+                    }
+
+            census_object(xs, ys, n);
+        }
+
+    free(seen);
+    free(xs);
+    free(ys);
+}
+
+/* Writes an object in RLE, "large" and "other" for the special entries */
+void object_rle(const object_t *o, char *out)
+{
+    if (o->w == 0 || o->w == 0xff)
+    {
+        strcpy(out, o->w ? "other" : "large");
+        return;
+    }
+
+    for (int y = 0; y < o->h; y++)
+    {
+        int x = 0;
+        while (x < o->w && (o->rows[y] >> x))
+        {
+            int s = (o->rows[y] >> x) & 1;
+            int run = 0;
+            while (x < o->w && ((o->rows[y] >> x) & 1) == s)
+            {
+                run++;
+                x++;
+            }
+            if (run > 1)
+                out += sprintf(out, "%d", run);
+            *out++ = s ? 'o' : 'b';
+        }
+        *out++ = y < o->h - 1 ? '$' : '!';
+    }
+    *out = '\0';
+}
+
+uint64_t population(void)
+{
+    uint64_t n = 0;
+    for (int y = 0; y < texture_h; y++)
+        for (int x = 0; x < texture_w; x++)
+            n += cell_state(x, y);
+
+    return n;
+}
+
+void run_soup(uint64_t soup, uint64_t seed, uint64_t cap, record_t *r)
+{
+    size_t cells = (size_t)texture_w * texture_h;
+    if (engine == ENGINE_BITS)
+    {
+        memset(bit_grid_a, 0, (size_t)words_w * texture_h * sizeof(uint64_t));
+        memset(bit_grid_b, 0, (size_t)words_w * texture_h * sizeof(uint64_t));
+    }
+    else
+    {
+        memset(cell_grid_a, 0, cells * sizeof(cell_t));
+        memset(cell_grid_b, 0, cells * sizeof(cell_t));
+    }
+    memset(tile_changed_a, 1, tiles_w * tiles_h);
+    generation = 0;
+
+    srand(seed + soup);
+    for (int y = texture_h / 4; y < texture_h - texture_h / 4; y++)
+        for (int x = texture_w / 4; x < texture_w - texture_w / 4; x++)
+            if (rand() % 2)
+                set_cell_state(x, y, ALIVE);
+
+    reset_cycles();
+
+    int points = cap < CURVE_POINTS ? (int)cap + 1 : CURVE_POINTS;
+    uint64_t interval = cap / (points - 1 > 0 ? points - 1 : 1);
+    int point = 0;
+
+    for (;;)
+    {
+        if (point < points && generation == point * interval)
+            r->curve[point++] = population();
+        if (cycle_period || generation == cap)
+            break;
+        step();
+    }
+
+    /* Stable soups keep their final population */
+    uint32_t last = population();
+    while (point < points)
+        r->curve[point++] = last;
+
+    r->type = RECORD_SOUP;
+    r->lifespan = cycle_period ? cycle_start : generation;
+    r->period = cycle_period;
+
+    census_grid();
+}
+
+void run_soup_worker(int i, uint64_t seed, uint64_t cap, int fd)
+{
+    record_t r;
+
+    for (uint64_t soup = i; soup < soups; soup += workers)
+    {
+        memset(&r, 0, sizeof(r));
+        run_soup(soup, seed, cap, &r);
+        if (write(fd, &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+    }
+
+    for (size_t c = 0; c < CENSUS_SIZE; c++)
+    {
+        if (!census[c].count)
+            continue;
+        memset(&r, 0, sizeof(r));
+        r.type = RECORD_OBJECT;
+        r.census = census[c];
+        if (write(fd, &r, sizeof(r)) != sizeof(r))
+            _exit(1);
+    }
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+int compare_census(const void *a, const void *b)
+{
+    const census_t *x = (const census_t *)a;
+    const census_t *y = (const census_t *)b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return memcmp(&x->object, &y->object, sizeof(object_t));
+}
+
+/* Runs the soups and prints one line of JSON */
+int run_soups(uint64_t seed, uint64_t cap)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        fprintf(stderr, "[ERROR] Could not create a pipe\n");
+        return 1;
+    }
+
+    census = (census_t *)calloc(CENSUS_SIZE, sizeof(census_t));
+    if (workers > 1 && (uint64_t)workers > soups)
+        workers = soups;
+
+    double wall = wall_time();
+    struct rusage before, after;
+    getrusage(RUSAGE_CHILDREN, &before);
+
+    fflush(NULL);
+    for (int i = 0; i < workers; i++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            /* Workers are the unit of parallelism */
+            omp_set_num_threads(1);
+            close(fds[0]);
+            run_soup_worker(i, seed, cap, fds[1]);
+            _exit(0);
+        }
+        if (pid == -1)
+        {
+            fprintf(stderr, "[ERROR] Could not fork worker %d\n", i);
+            workers = i;
+            break;
+        }
+    }
+    close(fds[1]);
+
+    uint64_t *lifespans = (uint64_t *)malloc(soups * sizeof(uint64_t));
+    uint64_t *periods = (uint64_t *)malloc(soups * sizeof(uint64_t));
+    double curve[CURVE_POINTS] = { 0 };
+    uint64_t done = 0;
+    uint64_t generations = 0;
+    record_t r;
+
+    while (read(fds[0], &r, sizeof(r)) == sizeof(r))
+    {
+        if (r.type == RECORD_OBJECT)
+        {
+            census_add(&r.census.object, r.census.count);
+            continue;
+        }
+
+        lifespans[done] = r.lifespan;
+        periods[done++] = r.period;
+        generations += r.period ? r.lifespan + r.period : r.lifespan;
+        for (int p = 0; p < CURVE_POINTS; p++)
+            curve[p] += r.curve[p];
+    }
+    close(fds[0]);
+
+    int failed = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+
+    double wall_s = wall_time() - wall;
+    getrusage(RUSAGE_CHILDREN, &after);
+    double cpu_s = after.ru_utime.tv_sec - before.ru_utime.tv_sec
+        + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) * 1e-6
+        + after.ru_stime.tv_sec - before.ru_stime.tv_sec
+        + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) * 1e-6;
+
+    if (failed || done != soups)
+    {
+        fprintf(stderr, "[ERROR] A worker failed, %llu of %llu soups done\n",
+            (unsigned long long)done, (unsigned long long)soups);
+        return 1;
+    }
+
+    uint64_t stabilized = 0;
+    double lifespan_sum = 0;
+    for (uint64_t i = 0; i < soups; i++)
+    {
+        stabilized += periods[i] != 0;
+        lifespan_sum += lifespans[i];
+    }
+    qsort(lifespans, soups, sizeof(uint64_t), compare_u64);
+    qsort(periods, soups, sizeof(uint64_t), compare_u64);
+
+    printf("{\"program\": \"sdl-cgl\", \"engine\": \"%s\", "
+        "\"rule\": \"%s\", \"width\": %d, \"height\": %d, \"workers\": %d, "
+        "\"seed\": %llu, \"soups\": %llu, \"max_generations\": %llu, "
+        "\"wall_s\": %.6f, \"cpu_s\": %.6f, \"soups_per_s\": %.3f, "
+        "\"generations_per_s\": %.3f, \"stabilized\": %llu, "
+        "\"lifespan_mean\": %.3f, \"lifespan_median\": %llu, "
+        "\"lifespan_max\": %llu, \"periods\": {",
+        engine_names[engine], rule_name, texture_w, texture_h, workers,
+        (unsigned long long)seed, (unsigned long long)soups,
+        (unsigned long long)cap, wall_s, cpu_s, soups / wall_s,
+        generations / wall_s, (unsigned long long)stabilized,
+        lifespan_sum / soups, (unsigned long long)lifespans[soups / 2],
+        (unsigned long long)lifespans[soups - 1]);
+
+    /* Periods are sorted, unstable soups (0) first */
+    for (uint64_t i = soups - stabilized; i < soups; )
+    {
+        uint64_t j = i;
+        while (j < soups && periods[j] == periods[i])
+            j++;
+        printf("%s\"%llu\": %llu", i > soups - stabilized ? ", " : "",
+            (unsigned long long)periods[i], (unsigned long long)(j - i));
+        i = j;
+    }
+
+    int points = cap < CURVE_POINTS ? (int)cap + 1 : CURVE_POINTS;
+    printf("}, \"curve_interval\": %llu, \"population_curve\": [",
+        (unsigned long long)(cap / (points - 1 > 0 ? points - 1 : 1)));
+    for (int p = 0; p < points; p++)
+        printf("%s%.3f", p ? ", " : "", curve[p] / soups);
+
+    qsort(census, CENSUS_SIZE, sizeof(census_t), compare_census);
+    printf("], \"census\": [");
+    char rle[CENSUS_SIDE * (CENSUS_SIDE * 3 + 1) + 8];
+    for (size_t c = 0; c < CENSUS_SIZE && census[c].count; c++)
+    {
+        object_rle(&census[c].object, rle);
+        printf("%s{\"object\": \"%s\", \"count\": %llu}", c ? ", " : "",
+            rle, (unsigned long long)census[c].count);
+    }
+    printf("]}\n");
+
+    return 0;
+}
+
+/*
+ * Frame export. With -R, the pixel buffer is copied into a bounded queue every
+ * -I steps, and a writer thread turns the queued frames into one Y4M video, or
+ * into a sequence of PPM images. A headless run waits for the writer when the
+ * queue is full, so that every frame is written. With a window, the simulation
+ * has a display to keep up with instead: the frame is dropped, and dropped
+ * frames are counted.
+ *
+ * This block is the same in all four programs but for the copy of the pixel
+ * buffer in export_frame(), and is best changed in all of them at once.
+ */
+#define EXPORT_QUEUE 16
+
+char *export_path = NULL;
+int export_y4m = 0;
+uint64_t export_interval = 1;
+uint64_t export_steps = 0;
+uint64_t export_written = 0;
+uint64_t export_dropped = 0;
+int export_failed = 0;
+
+pixel_t *export_queue[EXPORT_QUEUE];
+uint64_t export_numbers[EXPORT_QUEUE]; /* Step of each queued frame */
+int export_head = 0;    /* Oldest queued frame */
+int export_count = 0;
+int export_done = 0;
+SDL_mutex *export_lock = NULL;
+SDL_cond *export_cond = NULL;
+SDL_Thread *export_thread = NULL;
+FILE *export_file = NULL;
+uint8_t *export_bytes = NULL;
+
+/* Writes one frame as RGB, or as the three planes of a Y4M frame (BT.601) */
+int write_frame(pixel_t *frame, uint64_t number)
+{
+    size_t cells = (size_t)texture_w * texture_h;
+
+    for (size_t i = 0; i < cells; i++)
+    {
+        int r = frame[i] >> 24;
+        int g = (frame[i] >> 16) & 0xff;
+        int b = (frame[i] >> 8) & 0xff;
+
+        if (export_y4m)
+        {
+            export_bytes[i] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+            export_bytes[cells + i] =
+                128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            export_bytes[2 * cells + i] =
+                128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+        }
+        else
+        {
+            export_bytes[3 * i] = r;
+            export_bytes[3 * i + 1] = g;
+            export_bytes[3 * i + 2] = b;
+        }
+    }
+
+    if (export_y4m)
+        return fputs("FRAME\n", export_file) == EOF
+            || fwrite(export_bytes, 3, cells, export_file) != cells ? -1 : 0;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%06llu.ppm", export_path,
+        (unsigned long long)number);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "P6\n%d %d\n255\n", texture_w, texture_h);
+    int ok = fwrite(export_bytes, 3, cells, f) == cells;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+int export_writer(void *data)
+{
+    (void)data;
+
+    SDL_LockMutex(export_lock);
+    for (;;)
+    {
+        while (export_count == 0 && !export_done)
+            SDL_CondWait(export_cond, export_lock);
+        if (export_count == 0)
+            break;
+
+        /* The simulation never touches queued frames */
+        pixel_t *frame = export_queue[export_head];
+        uint64_t number = export_numbers[export_head];
+        SDL_UnlockMutex(export_lock);
+
+        if (!export_failed && write_frame(frame, number) == -1)
+        {
+            fprintf(stderr, "[ERROR] Could not write frame %llu to '%s'\n",
+                (unsigned long long)number, export_path);
+            export_failed = 1;
+        }
+        else if (!export_failed)
+        {
+            export_written++;
+        }
+
+        SDL_LockMutex(export_lock);
+        export_head = (export_head + 1) % EXPORT_QUEUE;
+        export_count--;
+        SDL_CondSignal(export_cond);
+    }
+    SDL_UnlockMutex(export_lock);
+
+    return 0;
+}
+
+int export_start(void)
+{
+    size_t len = strlen(export_path);
+    export_y4m = len > 4 && strcmp(export_path + len - 4, ".y4m") == 0;
+
+    if (export_y4m)
+    {
+        export_file = fopen(export_path, "wb");
+        if (export_file == NULL)
+        {
+            fprintf(stderr, "[ERROR] Could not open '%s'\n", export_path);
+            return -1;
+        }
+        fprintf(export_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+            texture_w, texture_h, FPS);
+    }
+
+    size_t cells = (size_t)texture_w * texture_h;
+    for (int i = 0; i < EXPORT_QUEUE; i++)
+        export_queue[i] = (pixel_t *)malloc(cells * sizeof(pixel_t));
+    export_bytes = (uint8_t *)malloc(cells * 3);
+
+    export_lock = SDL_CreateMutex();
+    export_cond = SDL_CreateCond();
+    export_thread = SDL_CreateThread(export_writer, "export", NULL);
+
+    return 0;
+}
+
+/* Queues the pixel buffer on every export_interval-th call */
+void export_frame(void)
+{
+    if (!export_path || export_steps++ % export_interval)
+        return;
+
+    /* Without a window, nothing is lost by waiting for a slot */
+    SDL_LockMutex(export_lock);
+    while (export_count == EXPORT_QUEUE && !window)
+        SDL_CondWait(export_cond, export_lock);
+    int tail = (export_head + export_count) % EXPORT_QUEUE;
+    int full = export_count == EXPORT_QUEUE;
+    SDL_UnlockMutex(export_lock);
+
+    if (full)
+    {
+        export_dropped++;
+        return;
+    }
+
+    memcpy(export_queue[tail], pixels,
+        (size_t)texture_w * texture_h * sizeof(pixel_t));
+    export_numbers[tail] = export_steps - 1;
+
+    SDL_LockMutex(export_lock);
+    export_count++;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+}
+
+/* Writes the queued frames and stops the writer */
+void export_stop(void)
+{
+    if (!export_path)
+        return;
+
+    SDL_LockMutex(export_lock);
+    export_done = 1;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+    SDL_WaitThread(export_thread, NULL);
+
+    if (export_file)
+        fclose(export_file);
+    fprintf(stderr, "Exported %llu frames, dropped %llu\n",
+        (unsigned long long)export_written,
+        (unsigned long long)export_dropped);
+}
+
+/*
+ * Runs n steps without rendering and prints one line of JSON. The checksum
+ * covers the grid, so runs of different engines can be compared.
+ */
+void benchmark(uint64_t n, uint64_t seed)
+{
+    uint64_t start = generation;
+    uint64_t skipped = 0;
+    uint64_t steps = 0;
+    double wall = wall_time();
+    clock_t cpu = clock();
+
+    if (workers > 1)
+    {
+        if (step_workers(n) == 0)
+            steps = n;
+    }
+
+    while (steps < n && !(detect_cycles == CYCLES_STOP && cycle_period))
+    {
+        step();
+        skipped += tiles_skipped;
+        steps++;
+
+        if (export_path)
+        {
+            render();
+            export_frame();
+        }
+    }
+
+    double cpu_s = (double)(clock() - cpu) / CLOCKS_PER_SEC + workers_cpu_s;
+    double wall_s = wall_time() - wall;
+    double gens = (double)(generation - start);
+
+    uint64_t population = 0;
+    uint64_t checksum = 0xcbf29ce484222325;
+    for (int y = 0; y < texture_h; y++)
+        for (int x = 0; x < texture_w; x++)
+        {
+            int s = cell_state(x, y);
+            population += s;
+            checksum = (checksum ^ s) * 0x100000001b3;
+        }
+
+    printf("{\"program\": \"sdl-cgl\", \"engine\": \"%s\", "
+        "\"rule\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, "
+        "\"workers\": %d, "
+        "\"seed\": %llu, \"steps\": %llu, \"generations\": %.0f, "
+        "\"wall_s\": %.6f, \"cpu_s\": %.6f, "
+        "\"generations_per_s\": %.3f, \"cell_updates_per_s\": %.3f, "
+        "\"tiles_skipped\": %.6f, "
+        "\"cycle_start\": %lld, \"cycle_period\": %llu, "
+        "\"population\": %llu, \"checksum\": \"%016llx\"}\n",
+        engine_names[engine], rule_name, texture_w, texture_h,
+        omp_get_max_threads(), workers,
+        (unsigned long long)seed, (unsigned long long)steps, gens,
+        wall_s, cpu_s, gens / wall_s,
+        gens * texture_w * texture_h / wall_s,
+        engine > ENGINE_BITS ? 0.0
+            : (double)skipped / steps / (tiles_w * tiles_h),
+        cycle_period ? (long long)cycle_start : -1LL,
+        (unsigned long long)cycle_period,
+        (unsigned long long)population, (unsigned long long)checksum);
+}
+
+/*
+ * Frames go from the simulation thread to the main thread through a lock-free
+ * triple buffer. The simulation thread owns the back buffer, the main thread
+ * the front one, and the middle one is exchanged atomically by both. A frame
+ * is published after every step, replacing the middle one if the main thread
+ * has not taken it yet, and FRAME_FRESH tells whether it did.
+ *
+ * A frame only carries the rectangles repainted since the last frame the main
+ * thread took, so that whichever frame it takes brings the texture in sync
+ * with the pixel buffer. Their pixels sit at the same place as in the pixel
+ * buffer, the rest of the frame buffer is stale and never read. The simulation
+ * keeps the tiles it repainted since the previous frame apart, and folds them
+ * into what the next frame carries until a frame it published was taken.
+ */
+#define FRAME_FRESH 4
+#define MAX_RECTS 64
+
+typedef struct {
+    pixel_t *pixels;
+    SDL_Rect rects[MAX_RECTS];
+    int num_rects;
+} frame_t;
+
+frame_t frames[3];
+int frame_back = 0;     /* Simulation thread */
+int frame_front = 1;    /* Main thread */
+SDL_atomic_t frame_middle;
+
+SDL_atomic_t quit;
+
+void *dropped_pattern = NULL; /* Path waiting for the simulation thread */
+
+/*
+ * Merges the tiles repainted since the last frame taken into one rectangle per
+ * band of tile rows. Returns 0 if nothing was repainted since the previous
+ * frame.
+ */
+int collect_rects(frame_t *frame)
+{
+    int band = tiles_h / MAX_RECTS + 1;
+    int repainted = 0;
+
+    if (all_dirty)
+    {
+        memset(tile_dirty, 1, tiles_w * tiles_h);
+        all_dirty = 0;
+    }
+
+    frame->num_rects = 0;
+    for (int ty0 = 0; ty0 < tiles_h; ty0 += band)
+    {
+        int tx0 = tiles_w, tx1 = 0, ty1 = ty0, tya = -1;
+
+        for (int ty = ty0; ty < ty0 + band && ty < tiles_h; ty++)
+            for (int tx = 0; tx < tiles_w; tx++)
+            {
+                int t = tiles_w * ty + tx;
+
+                repainted |= tile_dirty[t];
+                if (!tile_dirty[t] && !tile_sent[t])
+                    continue;
+                if (tya < 0)
+                    tya = ty;
+                ty1 = ty + 1;
+                tx0 = tx < tx0 ? tx : tx0;
+                tx1 = tx + 1 > tx1 ? tx + 1 : tx1;
+            }
+
+        if (tya < 0)
+            continue;
+
+        int x1 = tx1 * TILE_W < texture_w ? tx1 * TILE_W : texture_w;
+        int y1 = ty1 * TILE_H < texture_h ? ty1 * TILE_H : texture_h;
+        frame->rects[frame->num_rects++] = (SDL_Rect){
+            tx0 * TILE_W, tya * TILE_H, x1 - tx0 * TILE_W, y1 - tya * TILE_H };
+    }
+
+    return repainted;
+}
+
+void publish_frame(void)
+{
+    frame_t *frame = &frames[frame_back];
+    if (!collect_rects(frame))
+        return;
+
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy(&frame->pixels[(size_t)texture_w * y + r->x],
+                &pixels[(size_t)texture_w * y + r->x], r->w * sizeof(pixel_t));
+    }
+
+    SDL_MemoryBarrierRelease();
+    int old = SDL_AtomicSet(&frame_middle, frame_back | FRAME_FRESH);
+    frame_back = old & 3;
+
+    /* Once the previous frame was taken, only this one may still be lost */
+    for (int t = 0; t < tiles_w * tiles_h; t++)
+    {
+        tile_sent[t] = old & FRAME_FRESH
+            ? tile_sent[t] | tile_dirty[t] : tile_dirty[t];
+        tile_dirty[t] = 0;
+    }
+}
+
+/* Uploads the newest frame, if one was published since the last call */
+void upload_frame(void)
+{
+    if (!(SDL_AtomicGet(&frame_middle) & FRAME_FRESH))
+        return;
+
+    frame_front = SDL_AtomicSet(&frame_middle, frame_front) & 3;
+    SDL_MemoryBarrierAcquire();
+
+    frame_t *frame = &frames[frame_front];
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        void *texels;
+        int pitch;
+
+        if (SDL_LockTexture(texture, r, &texels, &pitch) < 0)
+            continue;
+        for (int y = 0; y < r->h; y++)
+            memcpy((char *)texels + (size_t)pitch * y,
+                &frame->pixels[(size_t)texture_w * (r->y + y) + r->x],
+                r->w * sizeof(pixel_t));
+        SDL_UnlockTexture(texture);
+    }
+}
+
+int simulate(void *data)
+{
+    (void)data;
+
+    while (!SDL_AtomicGet(&quit))
+    {
+        /* Patterns dropped on the window are loaded between steps */
+        char *path = (char *)SDL_AtomicSetPtr(&dropped_pattern, NULL);
+        if (path)
+        {
+            load_pattern(path);
+            SDL_free(path);
+            reset_cycles();
+        }
+
+        /* Keep showing the cycle once it is found */
+        if (detect_cycles == CYCLES_STOP && cycle_period)
+        {
+            SDL_Delay(SLEEPTIME);
+            continue;
+        }
+
+        step();
+        render();
+        export_frame();
+
+        if (verbose && engine <= ENGINE_BITS)
+            fprintf(stderr, "generation %llu skipped %.3f\n",
+                (unsigned long long)generation,
+                (double)tiles_skipped / (tiles_w * tiles_h));
+
+        publish_frame();
+    }
+
+    return 0;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr,
+        "USAGE\n\n"
+        "    %s [-e engine] [-r rule] [-t threads] [-w workers] [-k log2]"
+        "\n        [-g generation] [-m nodes] [-A] [-v] [-P] [-X] [-b steps]"
+        "\n        [-S soups] [-s seed] [-G WxH] [-p pattern] [-M file]"
+        " [-C generations]\n        [-R file] [-I steps] [title]\n\n"
+        "OPTIONS\n\n"
+        "    -e <engine>    Stepping engine: 'bits' (default), 'scalar',"
+        " 'hashlife' or 'sparse'\n"
+        "    -r <rule>      Rule in B/S notation, defaults to B3/S23\n"
+        "    -t <threads>   Number of stepping threads\n"
+        "    -w <workers>   Split a headless run across <workers> processes\n"
+        "    -k <log2>      HashLife generations per step, as a power of two\n"
+        "    -g <gen>       Jump to generation <gen> before starting\n"
+        "    -m <nodes>     HashLife node cache size\n"
+        "    -A             Evaluate every tile, not only the active ones\n"
+        "    -v             Print the fraction of skipped tiles per step\n"
+        "    -P             Report when the grid enters a cycle\n"
+        "    -X             Stop once the grid enters a cycle\n"
+        "    -b <steps>     Run headless for <steps> steps and print timings\n"
+        "    -S <soups>     Run <soups> random soups headless, for at most -b"
+        " generations\n"
+        "    -s <seed>      Random seed, fixed to 1 when headless\n"
+        "    -G <WxH>       Grid size, defaults to 200x150\n"
+        "    -p <file>      Start from an RLE or Life 1.06 pattern\n"
+        "    -M <file>      Keep the grid in a memory-mapped file, resuming"
+        " from it if it exists\n"
+        "    -C <gens>      Checkpoint the grid file every <gens> generations\n"
+        "    -R <file>      Record frames to a .y4m video, or to"
+        " <file>NNNNNN.ppm\n"
+        "    -I <steps>     Record every <steps>-th step, defaults to 1\n",
+        prog);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t start_generation = 0;
+    uint64_t benchmark_steps = 0;
+    uint64_t seed = 0;
+    int seeded = 0;
+    char *pattern = NULL;
+    char *grid_path = NULL;
+    int restored = 0;
+    int workers_set = 0;
+    int births = rule_births, survivals = rule_survivals;
+
+    int opt;
+    while ((opt = getopt(argc, argv,
+        "e:r:t:w:k:g:m:AvPXb:S:s:G:p:M:C:R:I:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            engine = NUM_ENGINES;
+            for (int i = 0; i < NUM_ENGINES; i++)
+                if (strcmp(optarg, engine_names[i]) == 0)
+                    engine = i;
+            if (engine == NUM_ENGINES)
+            {
+                fprintf(stderr, "[ERROR] Unknown engine '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (parse_rule(optarg, &births, &survivals) == -1)
+            {
+                fprintf(stderr, "[ERROR] Invalid rule '%s'\n", optarg);
+                return 1;
+            }
+            rule_fixed = 1;
+            break;
+        case 't':
+            if (atoi(optarg) < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid number of threads '%s'\n",
+                    optarg);
+                return 1;
+            }
+            omp_set_num_threads(atoi(optarg));
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            workers_set = 1;
+            if (workers < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid number of workers '%s'\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            hl_step_log = atoi(optarg);
+            if (hl_step_log < 0 || hl_step_log > HL_MAX_LEVEL - 3)
+            {
+                fprintf(stderr, "[ERROR] Invalid step size 2^%s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            start_generation = strtoull(optarg, NULL, 10);
+            break;
+        case 'm':
+            hl_max_nodes = strtoull(optarg, NULL, 10);
+            break;
+        case 'A':
+            track_active = 0;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'P':
+            if (detect_cycles == CYCLES_OFF)
+                detect_cycles = CYCLES_REPORT;
+            break;
+        case 'X':
+            detect_cycles = CYCLES_STOP;
+            break;
+        case 'b':
+            benchmark_steps = strtoull(optarg, NULL, 10);
+            break;
+        case 'S':
+            soups = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            seeded = 1;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%dx%d", &texture_w, &texture_h) != 2
+                || texture_w < 3 || texture_h < 3)
+            {
+                fprintf(stderr, "[ERROR] Invalid grid size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'p':
+            pattern = optarg;
+            break;
+        case 'M':
+            grid_path = optarg;
+            break;
+        case 'C':
+            checkpoint_interval = strtoull(optarg, NULL, 10);
+            break;
+        case 'R':
+            export_path = optarg;
+            break;
+        case 'I':
+            export_interval = strtoull(optarg, NULL, 10);
+            if (export_interval == 0)
+            {
+                fprintf(stderr, "[ERROR] Invalid interval '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (grid_path)
+    {
+        if (engine > ENGINE_BITS)
+        {
+            fprintf(stderr, "[ERROR] Grid files need the 'bits' or 'scalar'"
+                " engine\n");
+            return 1;
+        }
+        if ((restored = open_grid_file(grid_path, &births, &survivals)) == -1)
+            return 1;
+    }
+
+    /* Empty regions of the unbounded universes must stay empty */
+    if ((births & 1) && engine >= ENGINE_HASHLIFE)
+    {
+        fprintf(stderr, "[ERROR] The %s engine does not support B0 rules\n",
+            engine_names[engine]);
+        return 1;
+    }
+    set_rule(births, survivals);
+
+    if (detect_cycles && engine > ENGINE_BITS)
+    {
+        fprintf(stderr, "[ERROR] Cycle detection needs the 'bits' or"
+            " 'scalar' engine\n");
+        return 1;
+    }
+
+    if (soups > 0)
+    {
+        if (engine > ENGINE_BITS || grid_path || pattern || start_generation
+            || export_path)
+        {
+            fprintf(stderr, "[ERROR] Soups need the 'bits' or 'scalar' engine,"
+                " without -p, -g, -M or -R\n");
+            return 1;
+        }
+        detect_cycles = CYCLES_QUIET;
+        if (!workers_set)
+            workers = omp_get_num_procs();
+    }
+    else if (workers > 1 && (engine > ENGINE_BITS || benchmark_steps == 0
+        || detect_cycles || grid_path || export_path))
+    {
+        fprintf(stderr, "[ERROR] Worker processes need a headless run of the"
+            " 'bits' or 'scalar' engine, without -P, -X, -M or -R\n");
+        return 1;
+    }
+
+    if (!seeded)
+        seed = benchmark_steps > 0 || soups > 0 ? 1 : time(NULL);
+    srand(seed);
+
+    size_t cells = (size_t)texture_w * texture_h;
+
+    if ((benchmark_steps == 0 || export_path) && soups == 0)
+        pixels = (pixel_t *)malloc(cells * sizeof(pixel_t));
+
+    /* Only the grids of the selected engine are needed */
+    if (grid_map && engine == ENGINE_SCALAR)
+    {
+        cell_grid_a = (cell_t *)(grid_map + GRID_PAGE);
+        cell_grid_b = (cell_t *)(grid_map + GRID_PAGE + grid_bytes);
+    }
+    else if (engine == ENGINE_SCALAR)
+    {
+        cell_grid_a = (cell_t *)calloc(cells, sizeof(cell_t));
+        cell_grid_b = (cell_t *)calloc(cells, sizeof(cell_t));
+    }
+
+    words_w = (texture_w + 63) / 64;
+    if (grid_map && engine == ENGINE_BITS)
+    {
+        bit_grid_a = (uint64_t *)(grid_map + GRID_PAGE);
+        bit_grid_b = (uint64_t *)(grid_map + GRID_PAGE + grid_bytes);
+    }
+    else if (engine == ENGINE_BITS)
+    {
+        bit_grid_a = (uint64_t *)calloc((size_t)words_w * texture_h,
+            sizeof(uint64_t));
+        bit_grid_b = (uint64_t *)calloc((size_t)words_w * texture_h,
+            sizeof(uint64_t));
+    }
+    zero_row = (uint64_t *)calloc(words_w, sizeof(uint64_t));
+
+    tiles_w = (texture_w + TILE_W - 1) / TILE_W;
+    tiles_h = (texture_h + TILE_H - 1) / TILE_H;
+    tile_changed_a = (uint8_t *)malloc(tiles_w * tiles_h);
+    tile_changed_b = (uint8_t *)malloc(tiles_w * tiles_h);
+    memset(tile_changed_a, 1, tiles_w * tiles_h);
+    if (pixels)
+    {
+        tile_dirty = (uint8_t *)calloc(tiles_w * tiles_h, 1);
+        tile_sent = (uint8_t *)calloc(tiles_w * tiles_h, 1);
+    }
+
+    /*
+     * Each slot is saved whole the first time, except the one holding the
+     * checkpoint a grid was restored from
+     */
+    if (grid_map)
+    {
+        tile_unsaved = (uint8_t *)malloc(tiles_w * tiles_h);
+        memset(tile_unsaved, restored ? 1 << !grid_header->slot : 3,
+            tiles_w * tiles_h);
+    }
+
+    hl_init();
+    sp_init();
+
+    if (soups > 0)
+        return run_soups(seed,
+            benchmark_steps ? benchmark_steps : SOUP_GENERATIONS);
+
+    /* Initialize white */
+    if (pixels)
+        memset(pixels, colors[DEAD], cells * sizeof(pixel_t));
+
+    if (restored)
+    {
+        for (int y = 0; y < texture_h && pixels; y++)
+            for (int x = 0; x < texture_w; x++)
+                paint(x, y, cell_state(x, y));
+    }
+    else if (pattern == NULL)
+        seed_cell_grid();
+    else if (load_pattern(pattern) != 0)
+        return 1;
+
+    /* A new grid file is resumable from its first generation */
+    if (grid_map && !restored)
+        checkpoint();
+
+    reset_cycles();
+
+    if (start_generation > 0)
+        jump(start_generation);
+
+    if (export_path)
+    {
+        if (export_start() == -1)
+            return 1;
+        render();
+        export_frame();
+    }
+
+    if (benchmark_steps > 0)
+    {
+        benchmark(benchmark_steps, seed);
+        export_stop();
+        if (grid_map)
+            checkpoint();
+        return 0;
+    }
+
+    Uint32 flags = SDL_WINDOW_HIDDEN;
+
+    if (SDL_Init(SDL_INIT_VIDEO) == -1)
+    {
+        fprintf(stderr, "SDL_Init(SDL_INIT_VIDEO) failed: %s\n",
+            SDL_GetError());
+        return 1;
+    }
+
+    if (SDL_CreateWindowAndRenderer(0, 0, flags, &window, &renderer) < 0)
+    {
+        fprintf(stderr, "SDL_CreateWindowAndRenderer() failed: %s\n",
+            SDL_GetError());
+        return 1;
+    }
+
+    /* Configure texture */
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+        SDL_TEXTUREACCESS_STREAMING, texture_w, texture_h);
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+    /* Stretch texture to rect */
+    SDL_Rect texture_rect;
+    texture_rect.w = window_w;
+    texture_rect.h = window_h;
+    texture_rect.x = 0;
+    texture_rect.y = 0;
+
+    /* Configure renderer */
+    SDL_SetRenderTarget(renderer, texture);
+
+    /* Configure window */
+    SDL_SetWindowTitle(window, optind < argc ? argv[optind] : "");
+    SDL_SetWindowSize(window, window_w, window_h);
+    if (getenv("SDL_FULLSCREEN") != NULL)
+        SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
+    else
+        SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED,
+            SDL_WINDOWPOS_CENTERED);
+    SDL_ShowWindow(window);
+
+    render();
+    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+
+    for (int i = 0; i < 3; i++)
+        frames[i].pixels = (pixel_t *)malloc(
+            (size_t)texture_w * texture_h * sizeof(pixel_t));
+    SDL_AtomicSet(&frame_middle, 2);
+    SDL_AtomicSet(&quit, 0);
+
+    SDL_Thread *simulation = SDL_CreateThread(simulate, "simulation", NULL);
+
+    SDL_bool done = SDL_FALSE;
+    while (!done)
+    {
+        upload_frame();
+        SDL_RenderCopy(renderer, texture, NULL, &texture_rect);
+        SDL_RenderPresent(renderer);
+        SDL_Delay(SLEEPTIME);
+
+        char *path;
+        SDL_Event event;
+        while (SDL_PollEvent(&event))
+        {
+            switch (event.type)
+            {
+            case SDL_QUIT:
+                done = SDL_TRUE;
+                break;
+            case SDL_DROPFILE:
+                path = (char *)SDL_AtomicSetPtr(&dropped_pattern,
+                    event.drop.file);
+                if (path)
+                    SDL_free(path);
+                break;
+            case SDL_KEYDOWN:
+                switch (event.key.keysym.sym)
+                {
+                case SDLK_q:
+                    done = SDL_TRUE;
+                    break;
+                }
+            }
+        }
+    }
+
+    SDL_AtomicSet(&quit, 1);
+    SDL_WaitThread(simulation, NULL);
+    SDL_free(dropped_pattern);
+    export_stop();
+
+    if (grid_map)
+        checkpoint();
+
     if (renderer)
         SDL_DestroyRenderer(renderer);
     if (window)
@@ -1,135 +1,1834 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
+#include <unistd.h>
 #include <time.h>
 #include <math.h>
 #include <omp.h>
 #include <SDL.h>
 
-#define FPS 30
-#define SLEEPTIME (1000 / FPS)
+#define FPS 30
+#define SLEEPTIME (1000 / FPS)
+
+#define SCALE 1 / 4
+#define WIDTH 800
+#define HEIGHT 600
+
+typedef uint32_t pixel_t;
+
+#define BLACK 0x404040ff
+#define WHITE 0xffffffff
+
+/*
+ * Rows are bit-packed, 64 cells per word, cell x in bit x % 64 of word x / 64.
+ * Cells beyond both ends of the row are dead, and so are the bits past its
+ * last cell.
+ */
+uint64_t *row_a = NULL; /* Current row */
+uint64_t *row_b = NULL;
+
+int words_w = 0;
+
+int random_row = 0;
+
+pixel_t *pixels = NULL;
+
+/* Entry i is all ones if neighborhood i, left * 4 + center * 2 + right lives */
+uint64_t rule_masks[8];
+
+#define cell(x) (colors == 2 \
+    ? (int)((row_a[(x) >> 6] >> ((x) & 63)) & 1) : cells_a[x])
+
+int window_w  = WIDTH,
+    window_h  = HEIGHT;
+
+/* SCALE must divide window dimensions */
+int texture_w = WIDTH * SCALE,
+    texture_h = HEIGHT * SCALE;
+
+SDL_Window *window = NULL;
+SDL_Renderer *renderer = NULL;
+SDL_Texture *texture = NULL;
+
+/*
+ * Span of each row repainted since the last frame, from dirty_x0 up to but
+ * not including dirty_x1.
+ */
+int *dirty_x0 = NULL;
+int *dirty_x1 = NULL;
+/* Spans repainted since the last frame taken, up to the previous frame */
+int *sent_x0 = NULL;
+int *sent_x1 = NULL;
+
+#define mark_dirty(x, y)            \
+do {                                \
+    if ((x) < dirty_x0[y])          \
+        dirty_x0[y] = (x);          \
+    if ((x) >= dirty_x1[y])         \
+        dirty_x1[y] = (x) + 1;      \
+} while (0)
+
+/*
+ * The space-time image is a ring of rows. Each generation overwrites the
+ * oldest row, and once the ring is full, the image is shown starting from
+ * row ring_top, wrapping around to row 0, so adding a row never moves the
+ * others.
+ */
+int ring_y = 0;     /* Row holding the newest generation */
+int ring_top = 0;   /* Row shown at the top */
+int ring_full = 0;
+
+#define PIXEL(x, y) pixels[((size_t)texture_w * (y)) + (x)]
+
+void swap(uint64_t **a, uint64_t **b)
+{
+    uint64_t *c = *a;
+    *a = *b;
+    *b = c;
+}
+
+/* Bit i of a Wolfram rule number is the next state of neighborhood i */
+void set_rule(uint64_t *masks, int rule)
+{
+    for (int i = 0; i < 8; i++)
+        masks[i] = (rule >> i) & 1 ? ~(uint64_t)0 : 0;
+}
+
+/*
+ * Next state of 64 cells from their left neighbors, themselves and their right
+ * neighbors: the sum of the neighborhoods that live.
+ */
+uint64_t apply_rule(uint64_t l, uint64_t c, uint64_t r, const uint64_t *masks)
+{
+    return (~l & ~c & ~r & masks[0])
+        | (~l & ~c & r & masks[1])
+        | (~l & c & ~r & masks[2])
+        | (~l & c & r & masks[3])
+        | (l & ~c & ~r & masks[4])
+        | (l & ~c & r & masks[5])
+        | (l & c & ~r & masks[6])
+        | (l & c & r & masks[7]);
+}
+
+/*
+ * Computes word w of the next row. The left and right neighbors of the 64
+ * cells are the word shifted by one, with the bit carried in from the next
+ * word.
+ */
+uint64_t evaluate_word(const uint64_t *row, const uint64_t *masks, int w)
+{
+    uint64_t c = row[w];
+    uint64_t l = c << 1 | (w > 0 ? row[w - 1] >> 63 : 0);
+    uint64_t r = c >> 1 | (w < words_w - 1 ? row[w + 1] << 63 : 0);
+
+    return apply_rule(l, c, r, masks);
+}
+
+void step_row(const uint64_t *row, uint64_t *next, const uint64_t *masks)
+{
+    for (int w = 0; w < words_w; w++)
+        next[w] = evaluate_word(row, masks, w);
+
+    /* Keep the bits past the last cell dead */
+    if (texture_w & 63)
+        next[words_w - 1] &= ((uint64_t)1 << (texture_w & 63)) - 1;
+}
+
+/*
+ * Rule families. Beside elementary rules, a rule may have up to MAX_COLORS
+ * colors and a radius of up to MAX_RADIUS cells, and be given by its Wolfram
+ * code in one of three families:
+ *
+ *     general      Digit i (base colors) of the code is the next color of
+ *                  neighborhood i, the cells read as a base-colors number,
+ *                  leftmost cell first.
+ *     totalistic   Digit s is the next color when the cells sum to s.
+ *     outer        Outer totalistic. Digit colors * s + c is the next color
+ *                  of a center of color c whose neighbors sum to s.
+ *
+ * Each family has its own kernels, generated for every radius so that the
+ * shifts and loop bounds are constants. Binary rules keep bit-packed rows:
+ * general rules look up 8 cells at a time in a table indexed by their
+ * 8 + 2 * radius cells, sum rules count the neighbors with bit-parallel
+ * adders. Rules with more colors use one byte per cell: general rules slide
+ * the neighborhood index along the row, sum rules slide the sum.
+ */
+#define MAX_COLORS 8
+#define MAX_RADIUS 3
+#define CELLS_PAD (MAX_RADIUS + 1) /* Dead cells on either side of byte rows */
+
+enum {
+    FAMILY_GENERAL,
+    FAMILY_TOTALISTIC,
+    FAMILY_OUTER,
+    NUM_FAMILIES
+};
+
+int family = FAMILY_GENERAL;
+int colors = 2;
+int radius = 1;
+const char *rule_name = "150";
+
+pixel_t palette[MAX_COLORS]; /* From WHITE for color 0 to BLACK */
+
+uint8_t *cells_a = NULL; /* Current row with more than two colors */
+uint8_t *cells_b = NULL;
+
+uint8_t *rule_table = NULL;     /* Next color of each neighborhood */
+int rule_table_size = 0;
+uint8_t *sum_table = NULL;      /* Next color at colors * sum + center */
+uint8_t *window_table = NULL;   /* Next 8 cells of each 8 + 2 * radius cells */
+uint64_t sum_masks[2 * (2 * MAX_RADIUS + 1)]; /* Binary sum_table as masks */
+
+void step_elementary(const uint64_t *row, uint64_t *next)
+{
+    step_row(row, next, rule_masks);
+}
+
+void (*step_bits)(const uint64_t *row, uint64_t *next) = step_elementary;
+void (*step_cells)(const uint8_t *row, uint8_t *next) = NULL;
+
+void swap_cells(uint8_t **a, uint8_t **b)
+{
+    uint8_t *c = *a;
+    *a = *b;
+    *b = c;
+}
+
+void clear_padding(uint64_t *row)
+{
+    if (texture_w & 63)
+        row[words_w - 1] &= ((uint64_t)1 << (texture_w & 63)) - 1;
+}
+
+/* Adds one bit to each of 64 bit-sliced counters of three bits */
+#define add_bit(s0, s1, s2, in)     \
+do {                                \
+    uint64_t c0 = (s0) & (in);      \
+    (s0) ^= (in);                   \
+    (s2) |= (s1) & c0;              \
+    (s1) ^= c0;                     \
+} while (0)
+
+#define DEFINE_KERNELS(R)                                                   \
+void step_window_r##R(const uint64_t *row, uint64_t *next)                  \
+{                                                                           \
+    const uint64_t mask = ((uint64_t)1 << (8 + 2 * R)) - 1;                 \
+                                                                            \
+    for (int w = 0; w < words_w; w++)                                       \
+    {                                                                       \
+        uint64_t prev = w > 0 ? row[w - 1] : 0;                             \
+        uint64_t c = row[w];                                                \
+        uint64_t succ = w < words_w - 1 ? row[w + 1] : 0;                   \
+                                                                            \
+        /* Cells from R before the word, the last byte needs the next */    \
+        uint64_t lo = c << R | prev >> (64 - R);                            \
+        uint64_t hi = c >> (56 - R) | succ << (8 + R);                      \
+        uint64_t out = (uint64_t)window_table[hi & mask] << 56;             \
+        for (int i = 0; i < 7; i++)                                         \
+            out |= (uint64_t)window_table[(lo >> 8 * i) & mask] << 8 * i;   \
+        next[w] = out;                                                      \
+    }                                                                       \
+    clear_padding(next);                                                    \
+}                                                                           \
+                                                                            \
+void step_sum_r##R(const uint64_t *row, uint64_t *next)                     \
+{                                                                           \
+    for (int w = 0; w < words_w; w++)                                       \
+    {                                                                       \
+        uint64_t prev = w > 0 ? row[w - 1] : 0;                             \
+        uint64_t c = row[w];                                                \
+        uint64_t succ = w < words_w - 1 ? row[w + 1] : 0;                   \
+        uint64_t s0 = 0, s1 = 0, s2 = 0;                                    \
+                                                                            \
+        for (int d = 1; d <= R; d++)                                        \
+        {                                                                   \
+            add_bit(s0, s1, s2, c << d | prev >> (64 - d));                 \
+            add_bit(s0, s1, s2, c >> d | succ << (64 - d));                 \
+        }                                                                   \
+                                                                            \
+        uint64_t out = 0;                                                   \
+        for (int s = 0; s <= 2 * R; s++)                                    \
+        {                                                                   \
+            uint64_t eq = (s & 1 ? s0 : ~s0) & (s & 2 ? s1 : ~s1)           \
+                & (s & 4 ? s2 : ~s2);                                       \
+            out |= eq & ((c & sum_masks[2 * s + 1])                         \
+                | (~c & sum_masks[2 * s]));                                 \
+        }                                                                   \
+        next[w] = out;                                                      \
+    }                                                                       \
+    clear_padding(next);                                                    \
+}                                                                           \
+                                                                            \
+void step_cells_table_r##R(const uint8_t *row, uint8_t *next)               \
+{                                                                           \
+    /* Weight of the cell leaving the neighborhood */                       \
+    int top = rule_table_size / colors;                                     \
+    int index = 0;                                                          \
+                                                                            \
+    for (int x = -R - 1; x < R; x++)                                        \
+        index = index * colors + row[x];                                    \
+    for (int x = 0; x < texture_w; x++)                                     \
+    {                                                                       \
+        index = (index - row[x - R - 1] * top) * colors + row[x + R];       \
+        next[x] = rule_table[index];                                        \
+    }                                                                       \
+}                                                                           \
+                                                                            \
+void step_cells_sum_r##R(const uint8_t *row, uint8_t *next)                 \
+{                                                                           \
+    int sum = 0;                                                            \
+                                                                            \
+    for (int x = -R; x < R; x++)                                            \
+        sum += row[x];                                                      \
+    for (int x = 0; x < texture_w; x++)                                     \
+    {                                                                       \
+        sum += row[x + R] - row[x - R - 1];                                 \
+        next[x] = sum_table[(sum - row[x]) * colors + row[x]];              \
+    }                                                                       \
+}
+
+DEFINE_KERNELS(1)
+DEFINE_KERNELS(2)
+DEFINE_KERNELS(3)
+
+void (*window_kernels[])(const uint64_t *, uint64_t *) = {
+    NULL, step_window_r1, step_window_r2, step_window_r3
+};
+void (*sum_kernels[])(const uint64_t *, uint64_t *) = {
+    NULL, step_sum_r1, step_sum_r2, step_sum_r3
+};
+void (*cells_table_kernels[])(const uint8_t *, uint8_t *) = {
+    NULL, step_cells_table_r1, step_cells_table_r2, step_cells_table_r3
+};
+void (*cells_sum_kernels[])(const uint8_t *, uint8_t *) = {
+    NULL, step_cells_sum_r1, step_cells_sum_r2, step_cells_sum_r3
+};
+
+/*
+ * Writes the first n base-colors digits of a decimal or 0x-prefixed
+ * hexadecimal code, least significant first. Returns -1 if the code is
+ * invalid or has more digits.
+ */
+int parse_code(const char *str, uint8_t *digits, int n)
+{
+    int base = 10;
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+    {
+        base = 16;
+        str += 2;
+    }
+    if (*str == '\0')
+        return -1;
+
+    /* Little-endian limbs of 32 bits */
+    int num_limbs = strlen(str) / 8 + 1;
+    uint32_t *limbs = (uint32_t *)calloc(num_limbs, sizeof(uint32_t));
+
+    for (const char *p = str; *p; p++)
+    {
+        int d = *p >= '0' && *p <= '9' ? *p - '0'
+            : *p >= 'a' && *p <= 'f' ? *p - 'a' + 10
+            : *p >= 'A' && *p <= 'F' ? *p - 'A' + 10 : 99;
+        if (d >= base)
+        {
+            free(limbs);
+            return -1;
+        }
+
+        uint64_t carry = d;
+        for (int i = 0; i < num_limbs; i++)
+        {
+            carry += (uint64_t)limbs[i] * base;
+            limbs[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+    }
+
+    /* Divide by colors n times, the remainders are the digits */
+    for (int i = 0; i < n; i++)
+    {
+        uint64_t rem = 0;
+        for (int j = num_limbs - 1; j >= 0; j--)
+        {
+            uint64_t v = rem << 32 | limbs[j];
+            limbs[j] = (uint32_t)(v / colors);
+            rem = v % colors;
+        }
+        digits[i] = (uint8_t)rem;
+    }
+
+    int rest = 0;
+    for (int j = 0; j < num_limbs; j++)
+        rest |= limbs[j] != 0;
+    free(limbs);
+
+    return rest ? -1 : 0;
+}
+
+/*
+ * Parses a rule, [T|O]<code>[/k<colors>][/r<radius>], T for totalistic and
+ * O for outer totalistic codes. Builds the tables and picks the kernels.
+ * Returns -1 if the rule is invalid.
+ */
+int parse_rule(const char *str)
+{
+    family = FAMILY_GENERAL;
+    if (*str == 'T')
+        family = FAMILY_TOTALISTIC;
+    else if (*str == 'O')
+        family = FAMILY_OUTER;
+    if (family != FAMILY_GENERAL)
+        str++;
+
+    char code[4096];
+    size_t len = strcspn(str, "/");
+    if (len >= sizeof(code))
+        return -1;
+    memcpy(code, str, len);
+    code[len] = '\0';
+
+    colors = 2;
+    radius = 1;
+    for (const char *p = str + len; *p == '/'; p += strcspn(p + 1, "/") + 1)
+    {
+        /* A trailing '/' has no letter, nor anything after it to read */
+        if (p[1] != 'k' && p[1] != 'r')
+            return -1;
+
+        char *end;
+        long v = strtol(p + 2, &end, 10);
+        if (end == p + 2 || (*end != '\0' && *end != '/'))
+            return -1;
+        if (p[1] == 'k')
+            colors = v;
+        else
+            radius = v;
+    }
+    if (colors < 2 || colors > MAX_COLORS || radius < 1 || radius > MAX_RADIUS)
+        return -1;
+
+    int width = 2 * radius + 1;
+    int max_outer = 2 * radius * (colors - 1);
+
+    int n = family == FAMILY_TOTALISTIC ? width * (colors - 1) + 1
+        : family == FAMILY_OUTER ? colors * (max_outer + 1) : 1;
+    if (family == FAMILY_GENERAL)
+        for (int i = 0; i < width; i++)
+            n *= colors;
+
+    uint8_t *digits = (uint8_t *)malloc(n);
+    if (parse_code(code, digits, n) == -1)
+    {
+        free(digits);
+        return -1;
+    }
+
+    if (family == FAMILY_GENERAL)
+    {
+        rule_table = digits;
+        rule_table_size = n;
+    }
+    else
+    {
+        sum_table = (uint8_t *)malloc(colors * (max_outer + 1));
+        for (int s = 0; s <= max_outer; s++)
+            for (int c = 0; c < colors; c++)
+                sum_table[s * colors + c] = family == FAMILY_TOTALISTIC
+                    ? digits[s + c] : digits[s * colors + c];
+        free(digits);
+    }
+
+    if (colors > 2)
+    {
+        step_cells = family == FAMILY_GENERAL
+            ? cells_table_kernels[radius] : cells_sum_kernels[radius];
+        return 0;
+    }
+
+    if (family != FAMILY_GENERAL)
+    {
+        for (int i = 0; i < 2 * (max_outer + 1); i++)
+            sum_masks[i] = sum_table[i] ? ~(uint64_t)0 : 0;
+        step_bits = sum_kernels[radius];
+        return 0;
+    }
+
+    if (radius == 1)
+    {
+        /* Elementary rules keep their boolean expression, see step_row */
+        int rule = 0;
+        for (int i = 0; i < 8; i++)
+            rule |= rule_table[i] << i;
+        set_rule(rule_masks, rule);
+        step_bits = step_elementary;
+        return 0;
+    }
+
+    /* Bit j of an entry is the next state of cells j to j + 2 * radius */
+    window_table = (uint8_t *)calloc((size_t)1 << (8 + 2 * radius), 1);
+    for (int v = 0; v < 1 << (8 + 2 * radius); v++)
+        for (int j = 0; j < 8; j++)
+        {
+            int index = 0;
+            for (int m = 0; m < width; m++)
+                index = index << 1 | ((v >> (j + m)) & 1);
+            window_table[v] |= rule_table[index] << j;
+        }
+    step_bits = window_kernels[radius];
+
+    return 0;
+}
+
+/*
+ * HashLife. With -e hashlife, the row is an unbounded binary tree of canonical
+ * nodes, so equal segments are stored once, and the successor of every node is
+ * memoized. A node of level L covers 2^L cells, level 0 nodes are single
+ * cells. The shown row is cells 0 to texture_w - 1 of the tree, and unlike
+ * with the 'bits' engine, the cells on either side of it evolve too.
+ *
+ * Segments of 16 cells, the base level, are advanced through lookup tables
+ * computed from the rule: hl_luts[t] gives the 8 center cells of every segment
+ * after 2^t generations.
+ */
+enum {
+    ENGINE_BITS,
+    ENGINE_HASHLIFE,
+    NUM_ENGINES
+};
+
+const char *engine_names[NUM_ENGINES] = {
+    [ENGINE_BITS]     = "bits",
+    [ENGINE_HASHLIFE] = "hashlife"
+};
+
+int engine = ENGINE_BITS;
+
+typedef struct node {
+    struct node *left, *right;
+    struct node *next;      /* Hash chain */
+    struct node *result;    /* Center advanced 2^step generations */
+    uint64_t population;
+    uint64_t bits;          /* Cells of levels up to 6, cell i in bit i */
+    int level;
+    int step;
+    int mark;
+} node_t;
+
+#define HL_MAX_LEVEL 62
+#define HL_BLOCK 4096
+#define HL_BASE_LEVEL 4
+
+node_t hl_leaves[2] = {
+    { .population = 0, .bits = 0, .mark = 1 },
+    { .population = 1, .bits = 1, .mark = 1 }
+};
+
+node_t *hl_empties[HL_MAX_LEVEL + 1];
+
+node_t **hl_table = NULL;
+size_t hl_table_size = 0;
+size_t hl_nodes = 0;
+size_t hl_max_nodes = 1 << 22; /* Nodes cached beyond the live ones */
+size_t hl_live = 0;             /* Nodes left by the last collection */
+
+node_t *hl_free = NULL;
+
+node_t *hl_root = NULL; /* Centered on cell 0 */
+
+int hl_step_log = 0; /* Generations per step, log2 */
+
+uint8_t hl_luts[HL_BASE_LEVEL - 1][1 << 16];
+
+size_t hl_hash(node_t *left, node_t *right)
+{
+    uint64_t h = (uintptr_t)left;
+    h = h * 0x9e3779b97f4a7c15 + (uintptr_t)right;
+    return (size_t)(h ^ (h >> 29));
+}
+
+void hl_rehash(size_t size)
+{
+    node_t **table = (node_t **)calloc(size, sizeof(node_t *));
+
+    for (size_t i = 0; i < hl_table_size; i++)
+    {
+        node_t *n = hl_table[i];
+        while (n)
+        {
+            node_t *next = n->next;
+            size_t h = hl_hash(n->left, n->right) & (size - 1);
+            n->next = table[h];
+            table[h] = n;
+            n = next;
+        }
+    }
+
+    free(hl_table);
+    hl_table = table;
+    hl_table_size = size;
+}
+
+/* Returns the canonical node with the given halves */
+node_t *hl_join(node_t *left, node_t *right)
+{
+    size_t h = hl_hash(left, right) & (hl_table_size - 1);
+
+    for (node_t *n = hl_table[h]; n; n = n->next)
+        if (n->left == left && n->right == right)
+            return n;
+
+    if (!hl_free)
+    {
+        node_t *block = (node_t *)malloc(HL_BLOCK * sizeof(node_t));
+        for (int i = 0; i < HL_BLOCK; i++)
+        {
+            block[i].next = hl_free;
+            hl_free = &block[i];
+        }
+    }
+
+    node_t *n = hl_free;
+    hl_free = n->next;
+
+    n->left = left;
+    n->right = right;
+    n->result = NULL;
+    n->population = left->population + right->population;
+    n->level = left->level + 1;
+    n->bits = n->level <= 6
+        ? left->bits | right->bits << (1 << left->level) : 0;
+    n->step = 0;
+    n->mark = 0;
+    n->next = hl_table[h];
+    hl_table[h] = n;
+
+    if (++hl_nodes > hl_table_size)
+        hl_rehash(hl_table_size * 2);
+
+    return n;
+}
+
+node_t *hl_empty(int level)
+{
+    if (!hl_empties[level])
+    {
+        node_t *e = hl_empty(level - 1);
+        hl_empties[level] = hl_join(e, e);
+    }
+
+    return hl_empties[level];
+}
+
+/* Surrounds the node with empty space, doubling its width */
+node_t *hl_expand(node_t *n)
+{
+    if (n->level >= HL_MAX_LEVEL)
+    {
+        fprintf(stderr, "[ERROR] HashLife row exceeds level %d\n",
+            HL_MAX_LEVEL);
+        exit(1);
+    }
+
+    node_t *e = hl_empty(n->level - 1);
+
+    return hl_join(hl_join(e, n->left), hl_join(n->right, e));
+}
+
+/* Center of a node, one level down */
+node_t *hl_center(node_t *n)
+{
+    return hl_join(n->left->right, n->right->left);
+}
+
+/* Builds a node of the given level from its cells */
+node_t *hl_from_bits(uint64_t bits, int level)
+{
+    if (level == 0)
+        return &hl_leaves[bits & 1];
+
+    int half = 1 << (level - 1);
+    return hl_join(hl_from_bits(bits, level - 1),
+        hl_from_bits(bits >> half, level - 1));
+}
+
+/*
+ * Returns the center of a node of level L >= HL_BASE_LEVEL, advanced 2^j
+ * generations, where j is capped at L - 2. The three overlapping subnodes one
+ * level down are reduced to their centers, advanced when j allows it, then
+ * regrouped into two nodes which are advanced again. Returns NULL, leaving
+ * the results found so far, once the cache holds more than -m nodes beyond
+ * the live ones and j > 0, so the caller can collect and take smaller steps.
+ */
+node_t *hl_successor(node_t *n, int j)
+{
+    int step = j < n->level - 2 ? j : n->level - 2;
+
+    if (n->result && n->step == step)
+        return n->result;
+
+    if (hl_nodes > hl_live + hl_max_nodes && j > 0)
+        return NULL;
+
+    node_t *r;
+
+    if (n->level == HL_BASE_LEVEL)
+    {
+        r = hl_from_bits(hl_luts[step][n->bits], HL_BASE_LEVEL - 1);
+    }
+    else
+    {
+        node_t *s[3] = { n->left, hl_center(n), n->right };
+
+        for (int i = 0; i < 3; i++)
+            if (!(s[i] = step == n->level - 2
+                ? hl_successor(s[i], j)
+                : hl_center(s[i])))
+                return NULL;
+
+        node_t *a = hl_successor(hl_join(s[0], s[1]), j);
+        node_t *b = a ? hl_successor(hl_join(s[1], s[2]), j) : NULL;
+        if (!b)
+            return NULL;
+
+        r = hl_join(a, b);
+    }
+
+    n->result = r;
+    n->step = step;
+
+    return r;
+}
+
+/* Builds the root from a row of cells starting at cell 0 */
+void hl_load_row(const uint64_t *row)
+{
+    int level = 6;
+    while ((int64_t)1 << level < texture_w)
+        level++;
+
+    /* One node per word, then pairs of nodes until one is left */
+    int n = 1 << (level - 6);
+    node_t **nodes = (node_t **)malloc(n * sizeof(node_t *));
+    for (int w = 0; w < n; w++)
+        nodes[w] = w < words_w ? hl_from_bits(row[w], 6) : hl_empty(6);
+
+    for (; n > 1; n /= 2)
+        for (int i = 0; i < n / 2; i++)
+            nodes[i] = hl_join(nodes[2 * i], nodes[2 * i + 1]);
+
+    hl_root = hl_join(hl_empty(level), nodes[0]);
+    free(nodes);
+}
+
+void hl_fill(node_t *n, int64_t x0, uint64_t *row)
+{
+    int64_t size = (int64_t)1 << n->level;
+
+    if (n->population == 0 || x0 >= texture_w || x0 + size <= 0)
+        return;
+
+    if (n->level <= 6)
+    {
+        for (uint64_t bits = n->bits; bits; bits &= bits - 1)
+        {
+            int64_t x = x0 + __builtin_ctzll(bits);
+            if (x >= 0 && x < texture_w)
+                row[x >> 6] |= (uint64_t)1 << (x & 63);
+        }
+        return;
+    }
+
+    hl_fill(n->left, x0, row);
+    hl_fill(n->right, x0 + size / 2, row);
+}
+
+/* Copies cells 0 to texture_w - 1 of the tree into the row */
+void hl_store_row(uint64_t *row)
+{
+    memset(row, 0, words_w * sizeof(uint64_t));
+    hl_fill(hl_root, -((int64_t)1 << (hl_root->level - 1)), row);
+}
+
+void hl_mark(node_t *n)
+{
+    if (n->mark)
+        return;
+
+    n->mark = 1;
+    hl_mark(n->left);
+    hl_mark(n->right);
+}
+
+/* Frees every node not reachable from the root, and results pointing to them */
+void hl_gc(void)
+{
+    hl_mark(hl_root);
+    for (int i = 1; i <= HL_MAX_LEVEL; i++)
+        if (hl_empties[i])
+            hl_mark(hl_empties[i]);
+
+    for (size_t i = 0; i < hl_table_size; i++)
+        for (node_t *n = hl_table[i]; n; n = n->next)
+            if (n->result && !n->result->mark)
+                n->result = NULL;
+
+    for (size_t i = 0; i < hl_table_size; i++)
+    {
+        node_t **link = &hl_table[i];
+        while (*link)
+        {
+            node_t *n = *link;
+            if (n->mark)
+            {
+                n->mark = 0;
+                link = &n->next;
+            }
+            else
+            {
+                *link = n->next;
+                n->next = hl_free;
+                hl_free = n;
+                hl_nodes--;
+            }
+        }
+    }
+
+    hl_live = hl_nodes;
+}
+
+/* Fills the lookup tables of the base level from the rule */
+void hl_init(void)
+{
+    for (int s = 0; s < 2; s++)
+        hl_leaves[s].left = hl_leaves[s].right = &hl_leaves[s];
+    hl_empties[0] = &hl_leaves[0];
+
+    for (int t = 0; t < HL_BASE_LEVEL - 1; t++)
+        for (uint64_t v = 0; v < 1 << 16; v++)
+        {
+            uint64_t c = v;
+            for (int g = 0; g < 1 << t; g++)
+                c = apply_rule(c << 1, c, c >> 1, rule_masks) & 0xffff;
+            hl_luts[t][v] = (c >> 4) & 0xff;
+        }
+
+    hl_rehash(1 << 16);
+}
+
+/*
+ * Advances the row 2^j generations. The root is first padded until the
+ * cells lie within its inner quarter and nothing can escape the result.
+ * If the cache fills up on the way, the nodes of the unfinished step are
+ * collected and the two halves of the step are taken one after the other.
+ */
+void hl_advance(int j)
+{
+    if (hl_nodes > hl_live + hl_max_nodes)
+        hl_gc();
+
+    while (hl_root->level < j + 2 || hl_root->population
+        != hl_root->left->right->right->population
+            + hl_root->right->left->left->population)
+        hl_root = hl_expand(hl_root);
+
+    node_t *r = hl_successor(hl_expand(hl_root), j);
+    if (r)
+    {
+        hl_root = r;
+        return;
+    }
+
+    hl_advance(j - 1);
+    hl_advance(j - 1);
+}
+
+/* Jumps ahead n generations, one power of two at a time */
+void hl_jump(uint64_t n)
+{
+    for (int j = 63; j >= 0; j--)
+        if ((n >> j) & 1)
+            hl_advance(j);
+}
+
+/* A single alive cell in the middle, or with -r a random row of density 1/2 */
+void init_row(uint64_t *row)
+{
+    memset(row, 0, words_w * sizeof(uint64_t));
+
+    if (!random_row)
+    {
+        int x = texture_w / 2;
+        row[x >> 6] |= (uint64_t)1 << (x & 63);
+        return;
+    }
+
+    for (int x = 0; x < texture_w; x++)
+        if (rand() % 2)
+            row[x >> 6] |= (uint64_t)1 << (x & 63);
+}
+
+/* Rows with more colors start from a cell of color 1, or uniform colors */
+void init_cells(uint8_t *row)
+{
+    memset(row, 0, texture_w);
+
+    if (!random_row)
+    {
+        row[texture_w / 2] = 1;
+        return;
+    }
+
+    for (int x = 0; x < texture_w; x++)
+        row[x] = rand() % colors;
+}
+
+void init(void)
+{
+    for (int c = 0; c < colors; c++)
+    {
+        int level = 0xff - c * (0xff - (BLACK >> 24)) / (colors - 1);
+        palette[c] = (pixel_t)level << 24 | level << 16 | level << 8 | 0xff;
+    }
+
+    if (colors > 2)
+        init_cells(cells_a);
+    else
+        init_row(row_a);
+
+    if (pixels)
+        for (int x = 0; x < texture_w; x++)
+            PIXEL(x, 0) = palette[cell(x)];
+}
+
+/* Draws the current row over the oldest one */
+void draw(void)
+{
+    int y = ring_y = (ring_y + 1) % texture_h;
+
+    /* Once the ring wrapped around, the oldest row follows the newest */
+    if (y == 0)
+        ring_full = 1;
+    if (ring_full)
+        ring_top = (y + 1) % texture_h;
+
+    for (int x = 0; x < texture_w; x++)
+        PIXEL(x, y) = palette[cell(x)];
+    dirty_x0[y] = 0;
+    dirty_x1[y] = texture_w;
+}
+
+void iterate(void)
+{
+    if (engine == ENGINE_HASHLIFE)
+    {
+        hl_advance(hl_step_log);
+        hl_store_row(row_a);
+    }
+    else if (colors > 2)
+    {
+        step_cells(cells_a, cells_b);
+        swap_cells(&cells_a, &cells_b);
+    }
+    else
+    {
+        step_bits(row_a, row_b);
+        swap(&row_a, &row_b);
+    }
+
+    if (pixels)
+        draw();
+}
+
+double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Frame export. With -R, the pixel buffer is copied into a bounded queue every
+ * -I steps, and a writer thread turns the queued frames into one Y4M video, or
+ * into a sequence of PPM images. A headless run waits for the writer when the
+ * queue is full, so that every frame is written. With a window, the simulation
+ * has a display to keep up with instead: the frame is dropped, and dropped
+ * frames are counted.
+ *
+ * This block is the same in all four programs but for the copy of the pixel
+ * buffer in export_frame(), and is best changed in all of them at once.
+ */
+#define EXPORT_QUEUE 16
+
+char *export_path = NULL;
+int export_y4m = 0;
+uint64_t export_interval = 1;
+uint64_t export_steps = 0;
+uint64_t export_written = 0;
+uint64_t export_dropped = 0;
+int export_failed = 0;
+
+pixel_t *export_queue[EXPORT_QUEUE];
+uint64_t export_numbers[EXPORT_QUEUE]; /* Step of each queued frame */
+int export_head = 0;    /* Oldest queued frame */
+int export_count = 0;
+int export_done = 0;
+SDL_mutex *export_lock = NULL;
+SDL_cond *export_cond = NULL;
+SDL_Thread *export_thread = NULL;
+FILE *export_file = NULL;
+uint8_t *export_bytes = NULL;
 
-#define SCALE 1 / 4
-#define WIDTH 800
-#define HEIGHT 600
+/* Writes one frame as RGB, or as the three planes of a Y4M frame (BT.601) */
+int write_frame(pixel_t *frame, uint64_t number)
+{
+    size_t cells = (size_t)texture_w * texture_h;
 
-typedef uint32_t pixel_t;
+    for (size_t i = 0; i < cells; i++)
+    {
+        int r = frame[i] >> 24;
+        int g = (frame[i] >> 16) & 0xff;
+        int b = (frame[i] >> 8) & 0xff;
 
-#define BLACK 0x404040ff
-#define WHITE 0xffffffff
+        if (export_y4m)
+        {
+            export_bytes[i] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+            export_bytes[cells + i] =
+                128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            export_bytes[2 * cells + i] =
+                128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+        }
+        else
+        {
+            export_bytes[3 * i] = r;
+            export_bytes[3 * i + 1] = g;
+            export_bytes[3 * i + 2] = b;
+        }
+    }
 
-char *rowbuff1 = NULL;
-char *rowbuff2 = NULL;
+    if (export_y4m)
+        return fputs("FRAME\n", export_file) == EOF
+            || fwrite(export_bytes, 3, cells, export_file) != cells ? -1 : 0;
 
-pixel_t *pixels = NULL;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%06llu.ppm", export_path,
+        (unsigned long long)number);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "P6\n%d %d\n255\n", texture_w, texture_h);
+    int ok = fwrite(export_bytes, 3, cells, f) == cells;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
 
-char *ruleset = NULL;
+int export_writer(void *data)
+{
+    (void)data;
 
-#define BUFF1(x) rowbuff1[1 + x]
-#define BUFF2(x) rowbuff2[1 + x]
+    SDL_LockMutex(export_lock);
+    for (;;)
+    {
+        while (export_count == 0 && !export_done)
+            SDL_CondWait(export_cond, export_lock);
+        if (export_count == 0)
+            break;
 
-int window_w  = WIDTH,
-    window_h  = HEIGHT;
+        /* The simulation never touches queued frames */
+        pixel_t *frame = export_queue[export_head];
+        uint64_t number = export_numbers[export_head];
+        SDL_UnlockMutex(export_lock);
 
-/* SCALE must divide window dimensions */
-int texture_w = WIDTH * SCALE,
-    texture_h = HEIGHT * SCALE;
+        if (!export_failed && write_frame(frame, number) == -1)
+        {
+            fprintf(stderr, "[ERROR] Could not write frame %llu to '%s'\n",
+                (unsigned long long)number, export_path);
+            export_failed = 1;
+        }
+        else if (!export_failed)
+        {
+            export_written++;
+        }
 
-SDL_Window *window = NULL;
-SDL_Renderer *renderer = NULL;
-SDL_Texture *texture = NULL;
+        SDL_LockMutex(export_lock);
+        export_head = (export_head + 1) % EXPORT_QUEUE;
+        export_count--;
+        SDL_CondSignal(export_cond);
+    }
+    SDL_UnlockMutex(export_lock);
 
-#define PIXEL(x, y) pixels[(texture_w * (y)) + (x)]
+    return 0;
+}
+
+int export_start(void)
+{
+    size_t len = strlen(export_path);
+    export_y4m = len > 4 && strcmp(export_path + len - 4, ".y4m") == 0;
+
+    if (export_y4m)
+    {
+        export_file = fopen(export_path, "wb");
+        if (export_file == NULL)
+        {
+            fprintf(stderr, "[ERROR] Could not open '%s'\n", export_path);
+            return -1;
+        }
+        fprintf(export_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+            texture_w, texture_h, FPS);
+    }
+
+    size_t cells = (size_t)texture_w * texture_h;
+    for (int i = 0; i < EXPORT_QUEUE; i++)
+        export_queue[i] = (pixel_t *)malloc(cells * sizeof(pixel_t));
+    export_bytes = (uint8_t *)malloc(cells * 3);
 
-#define ctoi(c) (int)((c) - '0')
+    export_lock = SDL_CreateMutex();
+    export_cond = SDL_CreateCond();
+    export_thread = SDL_CreateThread(export_writer, "export", NULL);
+
+    return 0;
+}
 
-void swap(char **a, char **b)
+/* Queues the pixel buffer on every export_interval-th call */
+void export_frame(void)
 {
-    char *c = *a;
-    *a = *b;
-    *b = c;
+    if (!export_path || export_steps++ % export_interval)
+        return;
+
+    /* Without a window, nothing is lost by waiting for a slot */
+    SDL_LockMutex(export_lock);
+    while (export_count == EXPORT_QUEUE && !window)
+        SDL_CondWait(export_cond, export_lock);
+    int tail = (export_head + export_count) % EXPORT_QUEUE;
+    int full = export_count == EXPORT_QUEUE;
+    SDL_UnlockMutex(export_lock);
+
+    if (full)
+    {
+        export_dropped++;
+        return;
+    }
+
+    /* Frames are exported oldest row first */
+    size_t top = (size_t)texture_w * ring_top;
+    size_t cells = (size_t)texture_w * texture_h;
+    memcpy(export_queue[tail], pixels + top, (cells - top) * sizeof(pixel_t));
+    memcpy(export_queue[tail] + cells - top, pixels, top * sizeof(pixel_t));
+    export_numbers[tail] = export_steps - 1;
+
+    SDL_LockMutex(export_lock);
+    export_count++;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
 }
 
-char stencil(char *s)
+/* Writes the queued frames and stops the writer */
+void export_stop(void)
 {
-    int i =
-        ctoi(s[0]) * (int)pow(2, 2) + ctoi(s[1]) * (int)pow(2, 1) + ctoi(s[2]);
-    return ruleset[7 - i];
+    if (!export_path)
+        return;
+
+    SDL_LockMutex(export_lock);
+    export_done = 1;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+    SDL_WaitThread(export_thread, NULL);
+
+    if (export_file)
+        fclose(export_file);
+    fprintf(stderr, "Exported %llu frames, dropped %llu\n",
+        (unsigned long long)export_written,
+        (unsigned long long)export_dropped);
 }
 
-void rule_combo(char *a, char *b, int n, int i, int k)
+/*
+ * Rule sweeps. With -S, every rule of a list is run headless from the same
+ * initial row, the rules in parallel. For each rule, one line of a table
+ * gives the density of the last row and the mean density of all rows, the
+ * block entropy of the last rows, and the transient and period after which
+ * a row repeats. The block entropy is the Shannon entropy of the blocks of
+ * BLOCK consecutive cells divided by BLOCK, so it lies between 0 and 1.
+ * Repeats are found by hashing every row into a table of small buckets,
+ * where a new row replaces the oldest of its bucket. A hash hit is only a
+ * candidate: the rows are then stepped again and compared word by word to get
+ * the exact period and transient. A row whose first occurrence has been
+ * replaced, when the table holds fewer rows than the period, goes unnoticed.
+ */
+#define SWEEP_GENERATIONS 1000  /* Default number of generations */
+#define BLOCK 8
+#define ENTROPY_ROWS 64
+#define HISTORY_SIZE (1 << 16)
+#define HISTORY_WAYS 4          /* Entries per bucket */
+
+typedef struct {
+    uint64_t hash;
+    uint64_t seen; /* Generation + 1, 0 for empty slots */
+} history_t;
+
+typedef struct {
+    int rule;
+    double density;
+    double mean_density;
+    double entropy;
+    long long transient;    /* -1 if no row repeated */
+    uint64_t period;
+} sweep_t;
+
+/* Parses a list like 30,90,100-110 or 'all', returns the number of rules */
+int parse_rules(const char *str, int *rules)
 {
-    static int j = 0;
-    if (i == n)
+    int selected[256] = { 0 };
+
+    if (strcmp(str, "all") == 0)
+        str = "0-255";
+
+    while (*str)
     {
-        if (j == k)
-            strcpy(b, a);
-        j++;
-        return;
+        char *end;
+        long a = strtol(str, &end, 10);
+        long b = a;
+        if (end == str)
+            return -1;
+        if (*end == '-')
+        {
+            str = end + 1;
+            b = strtol(str, &end, 10);
+            if (end == str)
+                return -1;
+        }
+        if (a < 0 || b > 255 || a > b)
+            return -1;
+        for (long i = a; i <= b; i++)
+            selected[i] = 1;
+
+        str = end;
+        if (*str == ',')
+            str++;
+        else if (*str)
+            return -1;
     }
-    a[i] = '0';
-    rule_combo(a, b, n, i + 1, k);
-    a[i] = '1';
-    rule_combo(a, b, n, i + 1, k);
+
+    int n = 0;
+    for (int i = 0; i < 256; i++)
+        if (selected[i])
+            rules[n++] = i;
+
+    return n;
 }
 
-char * get_ruleset(int k)
+uint64_t hash_row(const uint64_t *row)
 {
-    const int n = 8;
-    char a[n + 1];
-    char *b = (char *)malloc((n + 1) * sizeof(char));
-    rule_combo(a, b, n, 0, k);
-    return b;
+    uint64_t h = 0;
+    for (int w = 0; w < words_w; w++)
+    {
+        h = (h ^ row[w]) * 0x9e3779b97f4a7c15;
+        h ^= h >> 29;
+    }
+
+    /* Mix every bit into the low ones that pick the bucket */
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+    return h ^ (h >> 31);
 }
 
-void init(SDL_Texture *texture)
+/*
+ * Looks the hash up in its bucket and returns the generation + 1 of the row
+ * that had it, or stores it over the oldest entry and returns 0.
+ */
+uint64_t remember_row(history_t *history, uint64_t h, uint64_t g)
 {
-    int x = texture_w / 2;
-    BUFF1(x) = '1';
-    PIXEL(x, 0) = BLACK;
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+    history_t *bucket = &history[(h & (HISTORY_SIZE / HISTORY_WAYS - 1))
+        * HISTORY_WAYS];
+    history_t *oldest = bucket;
+
+    for (int i = 0; i < HISTORY_WAYS; i++)
+    {
+        if (bucket[i].seen && bucket[i].hash == h)
+            return bucket[i].seen;
+        if (bucket[i].seen < oldest->seen)
+            oldest = &bucket[i];
+    }
+
+    *oldest = (history_t){ h, g + 1 };
+    return 0;
+}
+
+/*
+ * Checks a hash hit between the row at generation g and an earlier one, p
+ * generations before. The period is the first return of the row to itself,
+ * at most p generations on; the transient is where the start row and the
+ * start row a period ahead first meet. Returns 0 if the row does not come
+ * back, a collision between different rows.
+ */
+int find_cycle(const uint64_t *start, const uint64_t *row, uint64_t p,
+    const uint64_t *masks, sweep_t *result)
+{
+    size_t size = words_w * sizeof(uint64_t);
+    uint64_t *a = (uint64_t *)malloc(size);
+    uint64_t *b = (uint64_t *)malloc(size);
+    uint64_t *c = (uint64_t *)malloc(size);
+    uint64_t period = 0;
+
+    memcpy(a, row, size);
+    for (uint64_t i = 1; i <= p && !period; i++)
+    {
+        step_row(a, b, masks);
+        swap(&a, &b);
+        if (memcmp(a, row, size) == 0)
+            period = i;
+    }
+
+    if (period)
+    {
+        memcpy(a, start, size);
+        memcpy(c, start, size);
+        for (uint64_t i = 0; i < period; i++)
+        {
+            step_row(c, b, masks);
+            swap(&c, &b);
+        }
+
+        long long transient = 0;
+        while (memcmp(a, c, size) != 0)
+        {
+            step_row(a, b, masks);
+            swap(&a, &b);
+            step_row(c, b, masks);
+            swap(&c, &b);
+            transient++;
+        }
+
+        result->transient = transient;
+        result->period = period;
+    }
+
+    free(a);
+    free(b);
+    free(c);
+    return period != 0;
+}
+
+uint64_t row_population(const uint64_t *row)
+{
+    uint64_t n = 0;
+    for (int w = 0; w < words_w; w++)
+        n += __builtin_popcountll(row[w]);
+
+    return n;
+}
+
+/* Counts the blocks of BLOCK cells starting at every cell of the row */
+void count_blocks(const uint64_t *row, uint64_t *counts)
+{
+    for (int x = 0; x + BLOCK <= texture_w; x++)
+    {
+        uint64_t bits = row[x >> 6] >> (x & 63);
+        if ((x & 63) > 64 - BLOCK)
+            bits |= row[(x >> 6) + 1] << (64 - (x & 63));
+        counts[bits & ((1 << BLOCK) - 1)]++;
+    }
+}
+
+void sweep_rule(const uint64_t *start, uint64_t n, sweep_t *result)
+{
+    uint64_t masks[8];
+    set_rule(masks, result->rule);
+
+    uint64_t *a = (uint64_t *)malloc(words_w * sizeof(uint64_t));
+    uint64_t *b = (uint64_t *)malloc(words_w * sizeof(uint64_t));
+    history_t *history = (history_t *)calloc(HISTORY_SIZE, sizeof(history_t));
+    uint64_t counts[1 << BLOCK] = { 0 };
+    uint64_t alive = 0;
+
+    memcpy(a, start, words_w * sizeof(uint64_t));
+    remember_row(history, hash_row(a), 0);
+    result->transient = -1;
+    result->period = 0;
+
+    for (uint64_t g = 1; g <= n; g++)
+    {
+        step_row(a, b, masks);
+        swap(&a, &b);
+        alive += row_population(a);
+
+        if (g + ENTROPY_ROWS > n)
+            count_blocks(a, counts);
+
+        if (result->transient >= 0)
+            continue;
+
+        uint64_t seen = remember_row(history, hash_row(a), g);
+        if (seen)
+            find_cycle(start, a, g - (seen - 1), masks, result);
+    }
+
+    if (n == 0)
+        count_blocks(a, counts);
+
+    result->density = (double)row_population(a) / texture_w;
+    result->mean_density = n ? (double)alive / n / texture_w
+        : result->density;
+
+    uint64_t blocks = 0;
+    for (int i = 0; i < 1 << BLOCK; i++)
+        blocks += counts[i];
+
+    result->entropy = 0;
+    for (int i = 0; i < 1 << BLOCK && blocks; i++)
+        if (counts[i])
+        {
+            double p = (double)counts[i] / blocks;
+            result->entropy -= p * log2(p) / BLOCK;
+        }
+
+    free(a);
+    free(b);
+    free(history);
+}
+
+/* Sweeps the rules for n generations and prints the table */
+void sweep(int *rules, int num_rules, uint64_t n, uint64_t seed)
+{
+    sweep_t *results = (sweep_t *)malloc(num_rules * sizeof(sweep_t));
+    uint64_t *start = (uint64_t *)malloc(words_w * sizeof(uint64_t));
+    init_row(start);
+
+    double wall = wall_time();
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num_rules; i++)
+    {
+        results[i].rule = rules[i];
+        sweep_rule(start, n, &results[i]);
+    }
+
+    double wall_s = wall_time() - wall;
+
+    printf("rule\tdensity\tmean_density\tentropy\ttransient\tperiod\n");
+    for (int i = 0; i < num_rules; i++)
+        printf("%d\t%.6f\t%.6f\t%.6f\t%lld\t%llu\n", results[i].rule,
+            results[i].density, results[i].mean_density, results[i].entropy,
+            results[i].transient, (unsigned long long)results[i].period);
+
+    fprintf(stderr, "Swept %d rules of %llu generations, width %d, seed %llu,"
+        " in %.3f s\n", num_rules, (unsigned long long)n, texture_w,
+        (unsigned long long)seed, wall_s);
+
+    free(results);
+    free(start);
 }
 
-void iterate(SDL_Texture *texture)
+/*
+ * Runs n generations without rendering and prints one line of JSON. HashLife
+ * jumps straight to generation n, so only the last row is recorded.
+ */
+void benchmark(uint64_t n, uint64_t seed)
 {
-    static int y = 0;
+    double wall = wall_time();
+    clock_t cpu = clock();
 
-    if (y == texture_h - 1)
+    if (engine == ENGINE_HASHLIFE)
     {
-        for (int i = 1; i < texture_h; i++)
-            memcpy(&PIXEL(0, i - 1), &PIXEL(0, i), texture_w * sizeof(pixel_t));
+        hl_jump(n);
+        hl_store_row(row_a);
+        if (pixels)
+        {
+            draw();
+            export_frame();
+        }
     }
     else
     {
-        y++;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            iterate();
+            export_frame();
+        }
     }
 
+    double cpu_s = (double)(clock() - cpu) / CLOCKS_PER_SEC;
+    double wall_s = wall_time() - wall;
+
+    uint64_t population = 0;
+    uint64_t checksum = 0xcbf29ce484222325;
     for (int x = 0; x < texture_w; x++)
     {
-        char s[3];
-        s[0] = BUFF1(x - 1);
-        s[1] = BUFF1(x);
-        s[2] = BUFF1(x + 1);
-        char r = stencil(s);
-        BUFF2(x) = r;
-        PIXEL(x, y) = (r == '1' ? BLACK : WHITE);
+        population += cell(x) != 0;
+        checksum = (checksum ^ ('0' + cell(x))) * 0x100000001b3;
     }
 
-    swap(&rowbuff2, &rowbuff1);
+    printf("{\"program\": \"sdl-eca\", \"engine\": \"%s\", "
+        "\"rule\": \"%s\", \"width\": %d, "
+        "\"seed\": %llu, \"generations\": %llu, "
+        "\"wall_s\": %.6f, \"cpu_s\": %.6f, "
+        "\"generations_per_s\": %.3f, \"cell_updates_per_s\": %.3f, "
+        "\"population\": %llu, \"checksum\": \"%016llx\"}\n",
+        engine_names[engine], rule_name, texture_w, (unsigned long long)seed,
+        (unsigned long long)n,
+        wall_s, cpu_s, n / wall_s, (double)n * texture_w / wall_s,
+        (unsigned long long)population, (unsigned long long)checksum);
+}
+
+/*
+ * Frames go from the simulation thread to the main thread through a lock-free
+ * triple buffer. The simulation thread owns the back buffer, the main thread
+ * the front one, and the middle one is exchanged atomically by both. A frame
+ * is published after every step, replacing the middle one if the main thread
+ * has not taken it yet, and FRAME_FRESH tells whether it did.
+ *
+ * A frame only carries the rectangles repainted since the last frame the main
+ * thread took, so that whichever frame it takes brings the texture in sync
+ * with the pixel buffer. Their pixels sit at the same place as in the pixel
+ * buffer, the rest of the frame buffer is stale and never read. The simulation
+ * keeps what it repainted since the previous frame apart, and folds it into
+ * what the next frame carries until a frame it published was taken.
+ */
+#define FRAME_FRESH 4
+#define MAX_RECTS 64
 
-    memset(rowbuff2, '0', (texture_w + 2) * sizeof(char));
+typedef struct {
+    pixel_t *pixels;
+    SDL_Rect rects[MAX_RECTS];
+    int num_rects;
+    int top;        /* ring_top of the frame */
+} frame_t;
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+frame_t frames[3];
+int frame_back = 0;     /* Simulation thread */
+int frame_front = 1;    /* Main thread */
+SDL_atomic_t frame_middle;
+
+SDL_atomic_t quit;
+
+/*
+ * Merges the spans repainted since the last frame taken into one rectangle per
+ * band of rows. Returns 0 if nothing was repainted since the previous frame.
+ */
+int collect_rects(frame_t *frame)
+{
+    int band = texture_h / MAX_RECTS + 1 > 16 ? texture_h / MAX_RECTS + 1 : 16;
+    int repainted = 0;
+
+    frame->num_rects = 0;
+    for (int y0 = 0; y0 < texture_h; y0 += band)
+    {
+        int x0 = texture_w, x1 = 0, y1 = y0, ya = -1;
+
+        for (int y = y0; y < y0 + band && y < texture_h; y++)
+        {
+            repainted |= dirty_x0[y] < dirty_x1[y];
+
+            int a = dirty_x0[y] < sent_x0[y] ? dirty_x0[y] : sent_x0[y];
+            int b = dirty_x1[y] > sent_x1[y] ? dirty_x1[y] : sent_x1[y];
+            if (a >= b)
+                continue;
+            if (ya < 0)
+                ya = y;
+            y1 = y + 1;
+            x0 = a < x0 ? a : x0;
+            x1 = b > x1 ? b : x1;
+        }
+
+        if (ya >= 0)
+            frame->rects[frame->num_rects++] =
+                (SDL_Rect){ x0, ya, x1 - x0, y1 - ya };
+    }
+
+    return repainted;
+}
+
+void publish_frame(void)
+{
+    frame_t *frame = &frames[frame_back];
+    if (!collect_rects(frame))
+        return;
+
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy(&frame->pixels[(size_t)texture_w * y + r->x],
+                &pixels[(size_t)texture_w * y + r->x], r->w * sizeof(pixel_t));
+    }
+
+    frame->top = ring_top;
+
+    SDL_MemoryBarrierRelease();
+    int old = SDL_AtomicSet(&frame_middle, frame_back | FRAME_FRESH);
+    frame_back = old & 3;
+
+    /* Once the previous frame was taken, only this one may still be lost */
+    for (int y = 0; y < texture_h; y++)
+    {
+        if (old & FRAME_FRESH)
+        {
+            sent_x0[y] = dirty_x0[y] < sent_x0[y] ? dirty_x0[y] : sent_x0[y];
+            sent_x1[y] = dirty_x1[y] > sent_x1[y] ? dirty_x1[y] : sent_x1[y];
+        }
+        else
+        {
+            sent_x0[y] = dirty_x0[y];
+            sent_x1[y] = dirty_x1[y];
+        }
+        dirty_x0[y] = texture_w;
+        dirty_x1[y] = 0;
+    }
+}
+
+/* Shows the rows of the last uploaded frame in dst, oldest first */
+void present_rows(SDL_Rect *dst)
+{
+    int top = frames[frame_front].top;
+    int split = (int)((int64_t)dst->h * (texture_h - top) / texture_h);
+
+    SDL_Rect old_src = { 0, top, texture_w, texture_h - top };
+    SDL_Rect old_dst = { dst->x, dst->y, dst->w, split };
+    SDL_RenderCopy(renderer, texture, &old_src, &old_dst);
+
+    if (top > 0)
+    {
+        SDL_Rect new_src = { 0, 0, texture_w, top };
+        SDL_Rect new_dst = { dst->x, dst->y + split, dst->w, dst->h - split };
+        SDL_RenderCopy(renderer, texture, &new_src, &new_dst);
+    }
+}
+
+/* Uploads the newest frame, if one was published since the last call */
+void upload_frame(void)
+{
+    if (!(SDL_AtomicGet(&frame_middle) & FRAME_FRESH))
+        return;
+
+    frame_front = SDL_AtomicSet(&frame_middle, frame_front) & 3;
+    SDL_MemoryBarrierAcquire();
+
+    frame_t *frame = &frames[frame_front];
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        void *texels;
+        int pitch;
+
+        if (SDL_LockTexture(texture, r, &texels, &pitch) < 0)
+            continue;
+        for (int y = 0; y < r->h; y++)
+            memcpy((char *)texels + (size_t)pitch * y,
+                &frame->pixels[(size_t)texture_w * (r->y + y) + r->x],
+                r->w * sizeof(pixel_t));
+        SDL_UnlockTexture(texture);
+    }
+}
+
+int simulate(void *data)
+{
+    (void)data;
+
+    while (!SDL_AtomicGet(&quit))
+    {
+        iterate();
+        export_frame();
+        publish_frame();
+    }
+
+    return 0;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr,
+        "USAGE\n\n"
+        "    %s [-e engine] [-k log2] [-m nodes] [-b generations] [-s seed]"
+        "\n        [-G WxH] [-r] [-S rules] [-R file] [-I generations] [rule]"
+        "\n\n"
+        "OPTIONS\n\n"
+        "    -e <engine>    Stepping engine: 'bits' (default) or 'hashlife'\n"
+        "    -k <log2>      HashLife only, 2^<log2> generations per row\n"
+        "    -m <nodes>     HashLife only, node cache size\n"
+        "    -b <gens>      Run headless for <gens> generations and print"
+        " timings\n"
+        "    -s <seed>      Random seed, fixed to 1 when headless\n"
+        "    -G <WxH>       Row width and rows shown, defaults to 200x150\n"
+        "    -r             Start from a random row instead of a single cell\n"
+        "    -S <rules>     Sweep rules headless, like 30,90,100-110 or 'all'"
+        "\n"
+        "    -R <file>      Record frames to a .y4m video, or to"
+        " <file>NNNNNN.ppm\n"
+        "    -I <gens>      Record every <gens>-th generation, defaults to 1\n"
+        "\nRULES\n\n"
+        "    [T|O]<code>[/k<colors>][/r<radius>], T for totalistic and O for"
+        "\n    outer totalistic codes, like 30, T1599/k3 or 0x6b5a3c21/r2\n",
+        prog);
 }
 
 int main(int argc, char **argv)
 {
-    srand(time(NULL));
+    uint64_t benchmark_generations = 0;
+    uint64_t seed = 0;
+    int seeded = 0;
+    int sweep_rules[256];
+    int num_sweep_rules = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:k:m:b:s:G:R:I:rS:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            engine = NUM_ENGINES;
+            for (int i = 0; i < NUM_ENGINES; i++)
+                if (strcmp(optarg, engine_names[i]) == 0)
+                    engine = i;
+            if (engine == NUM_ENGINES)
+            {
+                fprintf(stderr, "[ERROR] Unknown engine '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            hl_step_log = atoi(optarg);
+            if (hl_step_log < 0 || hl_step_log > HL_MAX_LEVEL - 3)
+            {
+                fprintf(stderr, "[ERROR] Invalid step size 2^%s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            hl_max_nodes = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            benchmark_generations = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            seeded = 1;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%dx%d", &texture_w, &texture_h) != 2
+                || texture_w < 1 || texture_h < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid grid size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            export_path = optarg;
+            break;
+        case 'I':
+            export_interval = strtoull(optarg, NULL, 10);
+            if (export_interval == 0)
+            {
+                fprintf(stderr, "[ERROR] Invalid interval '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            random_row = 1;
+            break;
+        case 'S':
+            num_sweep_rules = parse_rules(optarg, sweep_rules);
+            if (num_sweep_rules <= 0)
+            {
+                fprintf(stderr, "[ERROR] Invalid rule list '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    argc--;
+    if (num_sweep_rules > 0 && export_path)
+    {
+        fprintf(stderr, "[ERROR] Sweeps cannot be recorded\n");
+        return 1;
+    }
 
-    if (argc == 0)
-        ruleset = get_ruleset(150);
-    else
-        ruleset = get_ruleset(atoi(argv[1]));
+    if (num_sweep_rules > 0 && engine == ENGINE_HASHLIFE)
+    {
+        fprintf(stderr, "[ERROR] Sweeps need the 'bits' engine\n");
+        return 1;
+    }
+
+    if (!seeded)
+        seed = benchmark_generations > 0 || num_sweep_rules > 0
+            ? 1 : time(NULL);
+    srand(seed);
+
+    if (optind < argc)
+        rule_name = argv[optind];
+    if (parse_rule(rule_name) == -1)
+    {
+        fprintf(stderr, "[ERROR] Invalid rule '%s'\n", rule_name);
+        return 1;
+    }
+
+    if (engine == ENGINE_HASHLIFE
+        && (family != FAMILY_GENERAL || colors > 2 || radius > 1))
+    {
+        fprintf(stderr, "[ERROR] HashLife only runs elementary rules\n");
+        return 1;
+    }
+
+    /* Dead space would come alive everywhere at once */
+    if (engine == ENGINE_HASHLIFE && rule_table[0])
+    {
+        fprintf(stderr, "[ERROR] Rules where 000 lives need the 'bits'"
+            " engine\n");
+        return 1;
+    }
+
+    words_w = (texture_w + 63) / 64;
+    row_a = (uint64_t *)calloc(words_w, sizeof(uint64_t));
+    row_b = (uint64_t *)calloc(words_w, sizeof(uint64_t));
+    if (colors > 2)
+    {
+        cells_a = (uint8_t *)calloc(texture_w + 2 * CELLS_PAD, 1) + CELLS_PAD;
+        cells_b = (uint8_t *)calloc(texture_w + 2 * CELLS_PAD, 1) + CELLS_PAD;
+    }
+
+    if (num_sweep_rules > 0)
+    {
+        sweep(sweep_rules, num_sweep_rules, benchmark_generations > 0
+            ? benchmark_generations : SWEEP_GENERATIONS, seed);
+        return 0;
+    }
+
+    if (benchmark_generations == 0 || export_path)
+    {
+        size_t cells = (size_t)texture_w * texture_h;
+        pixels = (pixel_t *)malloc(cells * sizeof(pixel_t));
+        memset(pixels, 0xffffffff, cells * sizeof(pixel_t));
+
+        /* Nothing is dirty yet, the first upload covers the whole texture */
+        dirty_x0 = (int *)malloc(texture_h * sizeof(int));
+        dirty_x1 = (int *)calloc(texture_h, sizeof(int));
+        sent_x0 = (int *)malloc(texture_h * sizeof(int));
+        sent_x1 = (int *)calloc(texture_h, sizeof(int));
+        for (int y = 0; y < texture_h; y++)
+            dirty_x0[y] = sent_x0[y] = texture_w;
+    }
+
+    init();
+
+    if (engine == ENGINE_HASHLIFE)
+    {
+        hl_init();
+        hl_load_row(row_a);
+    }
+
+    if (export_path)
+    {
+        if (export_start() == -1)
+            return 1;
+        export_frame();
+    }
+
+    if (benchmark_generations > 0)
+    {
+        benchmark(benchmark_generations, seed);
+        export_stop();
+        return 0;
+    }
 
     Uint32 flags = SDL_WINDOW_HIDDEN;
 
@@ -147,14 +1846,6 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    rowbuff1 = (char *)calloc((texture_w + 2), sizeof(char));
-    rowbuff2 = (char *)calloc((texture_w + 2), sizeof(char));
-    memset(rowbuff1, '0', (texture_w + 2) * sizeof(char));
-    memset(rowbuff2, '0', (texture_w + 2) * sizeof(char));
-
-    pixels = (pixel_t *)malloc(texture_w * texture_h * sizeof(pixel_t));
-    memset(pixels, 0xffffffff, texture_w * texture_h * sizeof(pixel_t));
-
     /* Configure texture */
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
         SDL_TEXTUREACCESS_STREAMING, texture_w, texture_h);
@@ -180,15 +1871,23 @@ int main(int argc, char **argv)
             SDL_WINDOWPOS_CENTERED);
     SDL_ShowWindow(window);
 
-    init(texture);
+    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+
+    for (int i = 0; i < 3; i++)
+        frames[i].pixels = (pixel_t *)malloc(
+            (size_t)texture_w * texture_h * sizeof(pixel_t));
+    SDL_AtomicSet(&frame_middle, 2);
+    SDL_AtomicSet(&quit, 0);
+
+    SDL_Thread *simulation = SDL_CreateThread(simulate, "simulation", NULL);
 
     SDL_bool done = SDL_FALSE;
     while (!done)
     {
-        SDL_RenderCopy(renderer, texture, NULL, &texture_rect);
+        upload_frame();
+        present_rows(&texture_rect);
         SDL_RenderPresent(renderer);
         SDL_Delay(SLEEPTIME);
-        iterate(texture);
 
         SDL_Event event;
         while (SDL_PollEvent(&event))
@@ -209,6 +1908,10 @@ int main(int argc, char **argv)
         }
     }
 
+    SDL_AtomicSet(&quit, 1);
+    SDL_WaitThread(simulation, NULL);
+    export_stop();
+
     if (renderer)
         SDL_DestroyRenderer(renderer);
     if (window)
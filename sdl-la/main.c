@@ -1,192 +1,2401 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
+#include <unistd.h>
 #include <time.h>
 #include <omp.h>
 #include <SDL.h>
 
-#define FPS 120
-#define SLEEPTIME (1000 / FPS)
+#define FPS 120
+#define SLEEPTIME (1000 / FPS)
+
+#define N 0
+#define E 1
+#define S 2
+#define W 3
+
+#define ANT_COLOR 0xff4040ff
+#define PAGE_COLOR 0xd8d8e8ff
+
+#define SCALE 4
+#define WIDTH 800
+#define HEIGHT 600
+
+typedef uint32_t pixel_t;
+
+typedef struct {
+    /* State value corresponding to 'id' in state_t */
+    uint8_t state;
+} cell_t;
+
+/* Coordinates take 64 bits for the unbounded world, the rest packs behind */
+typedef struct {
+    int64_t x;
+    int64_t y;
+    int id;
+    uint8_t d;      /* N, E, S or W */
+    uint8_t state;  /* Internal state of the turmite */
+    uint8_t next;   /* State after the step a swarm is taking */
+} ant_t;
+
+typedef struct {
+    pixel_t hex;
+    char motion;
+    int id;
+} state_t;
+
+int NUM_STATES = 0;
+int NUM_ANT_STATES = 1;
+
+#define MAX_STATES 256
+#define MAX_ANT_STATES 256
+
+/*
+ * Rules of a turmite: for each internal state and color, the color written,
+ * the turn in quarter turns clockwise, and the next internal state. Plain
+ * rules such as "RL" have a single state and advance the color.
+ */
+typedef struct {
+    uint8_t color;
+    uint8_t turn;
+    uint8_t state;
+} rule_t;
+
+rule_t *rule_table = NULL;
+
+#define rule(q, c) rule_table[(size_t)(q) * NUM_STATES + (c)]
+
+/* Turns in quarter turns clockwise: none, right, U-turn and left */
+const char turn_letters[] = "NRUL";
+
+/*
+ * The rules unrolled over directions. An ant in state q facing d has the key
+ * q * 4 + d, and entry c of transitions[key] packs what it does on color c:
+ * the key after the step in the low 16 bits, the color written in the next 8,
+ * and the change of cell index when it moves in the rest.
+ */
+int64_t (*transitions)[MAX_STATES] = NULL;
+
+#define ant_key(q, d) ((q) * 4 + (d))
+#define move_key(m) ((m) & 0xffff)
+#define move_color(m) ((uint8_t)((m) >> 16))
+#define move_index(m) ((m) >> 24)
+
+/* Moves for the directions N, E, S and W, numbered 0 to 3 */
+const int dx[4] = { 0, 1, 0, -1 };
+const int dy[4] = { -1, 0, 1, 0 };
+
+/* Steps per frame shown, 0 to adapt them to the speed of the ant */
+uint64_t frame_steps = 0;
+
+char *rules = NULL;
+
+state_t *states = NULL;
+
+cell_t *cell_grid = NULL;
+
+pixel_t *pixels = NULL;
+
+ant_t *ant = NULL;
+
+int num_ants = 1;
+
+/* With -U, the ant walks the unbounded world of pages instead of the grid */
+int unbounded = 0;
+
+int window_w  = WIDTH,
+    window_h  = HEIGHT;
+
+/* SCALE must divide window dimensions */
+int texture_w = WIDTH / SCALE,
+    texture_h = HEIGHT / SCALE;
+
+SDL_Window *window = NULL;
+SDL_Renderer *renderer = NULL;
+SDL_Texture *texture = NULL;
+
+#define grid(x, y) cell_grid[((size_t)texture_w * (y)) + (x)]
+#define pixel(x, y) pixels[((size_t)texture_w * (y)) + (x)]
+
+/*
+ * Span of each row repainted since the last frame, from dirty_x0 up to but
+ * not including dirty_x1.
+ */
+int *dirty_x0 = NULL;
+int *dirty_x1 = NULL;
+/* Spans repainted since the last frame taken, up to the previous frame */
+int *sent_x0 = NULL;
+int *sent_x1 = NULL;
+
+#define mark_dirty(x, y)            \
+do {                                \
+    if ((x) < dirty_x0[y])          \
+        dirty_x0[y] = (x);          \
+    if ((x) >= dirty_x1[y])         \
+        dirty_x1[y] = (x) + 1;      \
+} while (0)
+
+/* Headless runs have no pixel buffer */
+#define paint(x, y, hex)            \
+do {                                \
+    if (pixels && !unbounded)       \
+    {                               \
+        pixel(x, y) = hex;          \
+        mark_dirty(x, y);           \
+    }                               \
+} while (0)
+
+/*
+ * Unbounded world. With -U, the ant walks an endless plane instead of the
+ * wrapping grid. Cells are kept in square pages of PAGE_SIZE cells a side,
+ * allocated the first time the ant steps on them and found by coordinates in
+ * a hash table, so memory grows with the area visited only. The ant holds on
+ * to its page while stepping, where it moves by index as on the grid, and
+ * only looks a page up when it steps off its own. Lookups try the page found
+ * last first.
+ */
+#define PAGE_BITS 6
+#define PAGE_SIZE (1 << PAGE_BITS)
+
+typedef struct page {
+    int64_t x;          /* Coordinates in pages */
+    int64_t y;
+    struct page *next;  /* Next page in the same bucket */
+    cell_t cells[PAGE_SIZE * PAGE_SIZE];
+} page_t;
+
+page_t **buckets = NULL;
+size_t num_buckets = 0;
+size_t num_pages = 0;
+page_t *last_page = NULL;
+
+/* Bounding box of the pages, in pages */
+int64_t pages_x0 = 0, pages_y0 = 0, pages_x1 = 0, pages_y1 = 0;
+
+#define page_cell(page, x, y) \
+    (page)->cells[((y) & (PAGE_SIZE - 1)) * PAGE_SIZE + ((x) & (PAGE_SIZE - 1))]
+
+size_t page_hash(int64_t x, int64_t y)
+{
+    uint64_t h = (uint64_t)x * 0x9e3779b97f4a7c15ULL
+        ^ (uint64_t)y * 0xc2b2ae3d27d4eb4fULL;
+    return (h ^ (h >> 29)) & (num_buckets - 1);
+}
+
+/* The page at x, y, in pages, or NULL if it was never visited */
+page_t *find_page(int64_t x, int64_t y)
+{
+    if (last_page && last_page->x == x && last_page->y == y)
+        return last_page;
+
+    for (page_t *page = buckets[page_hash(x, y)]; page; page = page->next)
+        if (page->x == x && page->y == y)
+            return last_page = page;
+
+    return NULL;
+}
+
+/*
+ * Trails of highways. In the unbounded world, the periods of a highway are
+ * skipped without writing their cells: the trail is kept as a segment, count
+ * periods of a footprint, each moved by the shift from the one before. It only
+ * covers cells that were blank and had no page. A page gets the colors of the
+ * segments running through it when it is allocated, so that the ant finds
+ * them, and a cell without a page is looked up in the segments, the last one
+ * first. The color a segment leaves on a cell is the one of the last period
+ * on it: a period visits the cell of the footprint at x, y again after more
+ * periods only if the footprint holds x, y minus as many shifts.
+ */
+typedef struct {
+    int x;          /* Offset from the start of the period */
+    int y;
+    int t;          /* First step on the cell */
+    int before;     /* Periods since the last visit, 0 if none */
+    int after;      /* Periods until the next visit, 0 if none */
+    uint8_t from;
+    uint8_t to;
+} footprint_t;
+
+typedef struct {
+    int64_t x;          /* Start of the first period */
+    int64_t y;
+    int64_t count;      /* Periods */
+    int sx;             /* Shift from one period to the next */
+    int sy;
+    int size;           /* Cells of the footprint, sorted by y then x */
+    footprint_t *cells;
+    int x0, y0, x1, y1; /* Bounding box of the footprint */
+} segment_t;
+
+segment_t *segments = NULL;
+int num_segments = 0;
+
+/* a / b rounded down, for b > 0 */
+int64_t floor_div(int64_t a, int64_t b)
+{
+    return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+/*
+ * Narrows the periods from *t0 up to but not including *t1 to the ones in
+ * which p + t * s lies between a and b.
+ */
+void clip_periods(int64_t p, int s, int64_t a, int64_t b,
+    int64_t *t0, int64_t *t1)
+{
+    if (s < 0)
+    {
+        int64_t c = a;
+        p = -p;
+        s = -s;
+        a = -b;
+        b = -c;
+    }
+    if (s == 0)
+    {
+        if (p < a || p > b)
+            *t1 = *t0;
+        return;
+    }
+
+    int64_t lo = -floor_div(p - a, s);
+    int64_t hi = floor_div(b - p, s) + 1;
+    *t0 = lo > *t0 ? lo : *t0;
+    *t1 = hi < *t1 ? hi : *t1;
+}
+
+/* Narrows the periods to the ones whose footprint meets the box */
+void box_periods(const segment_t *s, int64_t x0, int64_t y0, int64_t x1,
+    int64_t y1, int64_t *t0, int64_t *t1)
+{
+    clip_periods(s->x, s->sx, x0 - s->x1, x1 - s->x0, t0, t1);
+    clip_periods(s->y, s->sy, y0 - s->y1, y1 - s->y0, t0, t1);
+}
+
+/* Bounding box of the cells of a segment */
+void segment_box(const segment_t *s, int64_t *x0, int64_t *y0, int64_t *x1,
+    int64_t *y1)
+{
+    int64_t dx = (s->count - 1) * s->sx, dy = (s->count - 1) * s->sy;
+
+    *x0 = s->x + s->x0 + (dx < 0 ? dx : 0);
+    *y0 = s->y + s->y0 + (dy < 0 ? dy : 0);
+    *x1 = s->x + s->x1 + (dx > 0 ? dx : 0);
+    *y1 = s->y + s->y1 + (dy > 0 ? dy : 0);
+}
+
+int compare_cells(const void *a, const void *b)
+{
+    const footprint_t *f = (const footprint_t *)a;
+    const footprint_t *g = (const footprint_t *)b;
+
+    if (f->y != g->y)
+        return f->y < g->y ? -1 : 1;
+    if (f->x != g->x)
+        return f->x < g->x ? -1 : 1;
+    return 0;
+}
+
+/* The cell of the footprint at x, y, or NULL */
+footprint_t *footprint_cell(const segment_t *s, int x, int y)
+{
+    footprint_t key = { .x = x, .y = y };
+    return (footprint_t *)bsearch(&key, s->cells, s->size,
+        sizeof(footprint_t), compare_cells);
+}
+
+/* Color a segment leaves on the cell at x, y, or -1 if it does not visit it */
+int segment_color(const segment_t *s, int64_t x, int64_t y)
+{
+    int64_t t0 = 0, t1 = s->count;
+
+    box_periods(s, x, y, x, y, &t0, &t1);
+    for (int64_t t = t1 - 1; t >= t0; t--)
+    {
+        footprint_t *f = footprint_cell(s, x - s->x - t * s->sx,
+            y - s->y - t * s->sy);
+        if (f)
+            return f->to;
+    }
+    return -1;
+}
+
+/*
+ * Writes the colors periods t0 up to t1 of a segment leave to the cells of the
+ * page, or of every page allocated if it is NULL. Cells a later period visits
+ * again are left to that period.
+ */
+void write_segment(const segment_t *s, int64_t t0, int64_t t1, page_t *page)
+{
+    for (int64_t t = t0; t < t1; t++)
+        for (int i = 0; i < s->size; i++)
+        {
+            const footprint_t *f = &s->cells[i];
+            if (f->after && t + f->after < s->count)
+                continue;
+
+            int64_t x = s->x + t * s->sx + f->x;
+            int64_t y = s->y + t * s->sy + f->y;
+            page_t *p = page ? page : find_page(x >> PAGE_BITS, y >> PAGE_BITS);
+            if (p && p->x == x >> PAGE_BITS && p->y == y >> PAGE_BITS)
+                page_cell(p, x, y).state = f->to;
+        }
+}
+
+/* The page at x, y, in pages, allocated on the first visit */
+page_t *get_page(int64_t x, int64_t y)
+{
+    page_t *page = find_page(x, y);
+    if (page)
+        return page;
+
+    /* Twice as many buckets once there are as many pages */
+    if (num_pages == num_buckets)
+    {
+        page_t **old = buckets;
+        size_t old_size = num_buckets;
+
+        num_buckets *= 2;
+        buckets = (page_t **)calloc(num_buckets, sizeof(page_t *));
+        for (size_t b = 0; b < old_size; b++)
+            while (old[b])
+            {
+                page = old[b];
+                old[b] = page->next;
+                size_t h = page_hash(page->x, page->y);
+                page->next = buckets[h];
+                buckets[h] = page;
+            }
+        free(old);
+    }
+
+    page = (page_t *)calloc(1, sizeof(page_t));
+    page->x = x;
+    page->y = y;
+
+    size_t h = page_hash(x, y);
+    page->next = buckets[h];
+    buckets[h] = page;
+
+    if (num_pages++ == 0)
+    {
+        pages_x0 = pages_x1 = x;
+        pages_y0 = pages_y1 = y;
+    }
+    pages_x0 = x < pages_x0 ? x : pages_x0;
+    pages_x1 = x > pages_x1 ? x : pages_x1;
+    pages_y0 = y < pages_y0 ? y : pages_y0;
+    pages_y1 = y > pages_y1 ? y : pages_y1;
+
+    /* Trails running through the page */
+    for (int i = 0; i < num_segments; i++)
+    {
+        int64_t t0 = 0, t1 = segments[i].count;
+        box_periods(&segments[i], x * PAGE_SIZE, y * PAGE_SIZE,
+            x * PAGE_SIZE + PAGE_SIZE - 1, y * PAGE_SIZE + PAGE_SIZE - 1,
+            &t0, &t1);
+        write_segment(&segments[i], t0, t1, page);
+    }
+
+    return last_page = page;
+}
+
+/* Color of the cell at x, y of the world, without allocating its page */
+int world_color(int64_t x, int64_t y)
+{
+    page_t *page = find_page(x >> PAGE_BITS, y >> PAGE_BITS);
+    if (page)
+        return page_cell(page, x, y).state;
+
+    for (int i = num_segments - 1; i >= 0; i--)
+    {
+        int color = segment_color(&segments[i], x, y);
+        if (color >= 0)
+            return color;
+    }
+    return 0;
+}
+
+#define world(x, y) \
+    page_cell(get_page((x) >> PAGE_BITS, (y) >> PAGE_BITS), x, y)
+
+void init_world(void)
+{
+    num_buckets = 1024;
+    buckets = (page_t **)calloc(num_buckets, sizeof(page_t *));
+}
+
+pixel_t rcolor(void)
+{
+    char *hex = "0123456789abcdef";
+    char color[9];
+    memset(color, 'f', 8);
+
+    int i = (rand() % 3) * 2;
+    color[i] = hex[rand() % 16];
+    color[i + 1] = hex[rand() % 16];
+    i =  (rand() % 3) * 2;
+    color[i] = '4';
+    color[i + 1] = '0';
+
+    return (pixel_t)strtol(color, NULL, 16);
+}
+
+/* Quarter turns clockwise for a turn of the turmite notation, -1 if invalid */
+int turmite_turn(int turn)
+{
+    switch (turn)
+    {
+    case 1:
+        return 0;
+    case 2:
+        return 1;
+    case 4:
+        return 2;
+    case 8:
+        return 3;
+    }
+    return -1;
+}
+
+/*
+ * Reads a turmite in the notation of Golly, such as {{{1, 2, 0}, {0, 8, 0}}}:
+ * for each internal state, for each color, the color written, the turn, 1 for
+ * none, 2 right, 4 U-turn and 8 left, and the next state. Returns -1 if the
+ * turmite is malformed.
+ */
+int parse_turmite(char *str)
+{
+    /* Every triple takes at least 7 characters */
+    size_t max = strlen(str) / 7 + 1;
+    long *values = (long *)malloc(max * 3 * sizeof(long));
+    int depth = 0, n = 0, colors = 0, k = 0, closed = 0;
+    char *p = str;
+
+    NUM_ANT_STATES = 0;
+
+    for (; *p; p++)
+    {
+        if (*p == '{' && !closed && depth < 3)
+        {
+            colors = ++depth == 2 ? 0 : colors;
+            k = 0;
+        }
+        else if (*p == '}' && depth == 3 && k == 3)
+        {
+            depth--;
+            n++;
+            colors++;
+        }
+        else if (*p == '}' && depth == 2 && colors > 0
+            && (NUM_ANT_STATES == 0 || colors == NUM_STATES))
+        {
+            depth--;
+            NUM_STATES = colors;
+            NUM_ANT_STATES++;
+        }
+        else if (*p == '}' && depth == 1)
+        {
+            depth--;
+            closed = 1;
+        }
+        else if (*p >= '0' && *p <= '9' && depth == 3 && k < 3
+            && (size_t)n < max)
+        {
+            values[n * 3 + k++] = strtol(p, &p, 10);
+            p--;
+        }
+        else if (*p != ',' && *p != ' ')
+            break;
+    }
+
+    if (*p != '\0' || !closed || NUM_ANT_STATES < 1)
+    {
+        fprintf(stderr, "[ERROR] Invalid turmite '%s'\n", str);
+        return -1;
+    }
+    if (NUM_ANT_STATES > MAX_ANT_STATES || NUM_STATES > MAX_STATES)
+    {
+        fprintf(stderr, "[ERROR] Turmites need 1 to %d states and 1 to %d"
+            " colors\n", MAX_ANT_STATES, MAX_STATES);
+        return -1;
+    }
+
+    rule_table = (rule_t *)malloc(n * sizeof(rule_t));
+    for (int i = 0; i < n; i++)
+    {
+        long *v = &values[i * 3];
+        if (v[0] >= NUM_STATES || turmite_turn(v[1]) < 0
+            || v[2] >= NUM_ANT_STATES)
+        {
+            fprintf(stderr, "[ERROR] Invalid turmite entry {%ld, %ld, %ld}\n",
+                v[0], v[1], v[2]);
+            return -1;
+        }
+        rule_table[i] = (rule_t){
+            .color = v[0],
+            .turn = turmite_turn(v[1]),
+            .state = v[2]
+        };
+    }
+
+    free(values);
+    return 0;
+}
+
+/*
+ * Reads the rules: a turmite, or the turn taken on each color, 'L', 'R', 'N'
+ * for none or 'U' for a U-turn. Returns -1 if they are invalid.
+ */
+int parse_rules(char *str)
+{
+    if (str[0] == '{')
+        return parse_turmite(str);
+
+    NUM_ANT_STATES = 1;
+    NUM_STATES = strlen(str);
+
+    if (NUM_STATES < 1 || NUM_STATES > MAX_STATES)
+    {
+        fprintf(stderr, "[ERROR] Rules need 1 to %d colors\n", MAX_STATES);
+        return -1;
+    }
+
+    rule_table = (rule_t *)malloc(NUM_STATES * sizeof(rule_t));
+    for (int c = 0; c < NUM_STATES; c++)
+    {
+        char *turn = strchr(turn_letters, str[c]);
+        if (turn == NULL)
+        {
+            fprintf(stderr, "[ERROR] Invalid turn '%c'\n", str[c]);
+            return -1;
+        }
+        rule_table[c] = (rule_t){
+            .color = (c + 1) % NUM_STATES,
+            .turn = turn - turn_letters,
+            .state = 0
+        };
+    }
+
+    return 0;
+}
+
+void init(ant_t *ant, int d)
+{
+    /* Cells are stored row by row, in the grid or in a page */
+    int stride = unbounded ? PAGE_SIZE : texture_w;
+
+    states = (state_t *)malloc(NUM_STATES * sizeof(state_t));
+
+    /* Colors are shown with the turn the first state takes on them */
+    for (int i = 0; i < NUM_STATES; i++)
+    {
+        state_t color = (state_t){
+            .hex = NUM_STATES == 2 ? (i == 0 ? 0xffffffff : 0x404040ff)
+                : rcolor(),
+            .motion = turn_letters[rule(0, i).turn],
+            .id = i
+        };
+        states[i] = color;
+    }
+
+    transitions = (int64_t (*)[MAX_STATES])calloc(NUM_ANT_STATES * 4,
+        sizeof(*transitions));
+    for (int q = 0; q < NUM_ANT_STATES; q++)
+        for (int c = 0; c < NUM_STATES; c++)
+            for (int d = 0; d < 4; d++)
+            {
+                int t = (d + rule(q, c).turn) & 3;
+                transitions[ant_key(q, d)][c] =
+                    ((int64_t)dy[t] * stride + dx[t]) * (1 << 24)
+                    + (rule(q, c).color << 16)
+                    + ant_key(rule(q, c).state, t);
+            }
+
+    ant->d = d;
+    ant->state = 0;
+
+    /* The unbounded world has its origin where the ant starts */
+    if (unbounded)
+    {
+        ant->x = 0;
+        ant->y = 0;
+        return;
+    }
+
+    ant->x = texture_w / 2;
+    ant->y = texture_h / 2;
+
+    grid(ant->x, ant->y).state = 0;
+    if (num_ants == 1)
+        paint(ant->x, ant->y, ANT_COLOR);
+}
+
+/*
+ * One step of an ant held in locals: turn on the color of the cell, write the
+ * new color and take the new state, then move one cell, wrapping world edges.
+ * The ant carries the index of its cell and its key, and a single lookup in
+ * transitions gives the next key and the change of index, keeping the chain
+ * from one cell to the next short. Its coordinates are only needed to catch
+ * the edges.
+ */
+#define step_ant(x, y, k, i)                            \
+do {                                                    \
+    int64_t m = transitions[k][cell_grid[i].state];     \
+    cell_grid[i].state = move_color(m);                 \
+    k = move_key(m);                                    \
+    i += move_index(m);                                 \
+    x += dx[k & 3];                                     \
+    y += dy[k & 3];                                     \
+    if ((unsigned)x >= (unsigned)texture_w)             \
+    {                                                   \
+        x = x < 0 ? texture_w - 1 : 0;                  \
+        i = (int64_t)texture_w * y + x;                 \
+    }                                                   \
+    if ((unsigned)y >= (unsigned)texture_h)             \
+    {                                                   \
+        y = y < 0 ? texture_h - 1 : 0;                  \
+        i = (int64_t)texture_w * y + x;                 \
+    }                                                   \
+} while (0)
+
+/*
+ * Runs n steps of the ant in the unbounded world. Steps are taken as on the
+ * grid, within the page of the ant, whose rows are PAGE_SIZE cells apart. The
+ * only branch is for stepping off the page, into the page next to it.
+ */
+void run_page_steps(ant_t *ant, uint64_t n)
+{
+    page_t *page = get_page(ant->x >> PAGE_BITS, ant->y >> PAGE_BITS);
+    cell_t *cells = page->cells;
+    int x = ant->x & (PAGE_SIZE - 1), y = ant->y & (PAGE_SIZE - 1);
+    size_t key = ant_key(ant->state, ant->d);
+    int64_t i = y * PAGE_SIZE + x;
+
+    for (uint64_t k = 0; k < n; k++)
+    {
+        int64_t m = transitions[key][cells[i].state];
+        cells[i].state = move_color(m);
+        key = move_key(m);
+        i += move_index(m);
+        x += dx[key & 3];
+        y += dy[key & 3];
+
+        if ((unsigned)(x | y) >= PAGE_SIZE)
+        {
+            page = get_page(page->x + (x >> PAGE_BITS),
+                page->y + (y >> PAGE_BITS));
+            cells = page->cells;
+            x &= PAGE_SIZE - 1;
+            y &= PAGE_SIZE - 1;
+            i = y * PAGE_SIZE + x;
+        }
+    }
+
+    ant->x = page->x * PAGE_SIZE + x;
+    ant->y = page->y * PAGE_SIZE + y;
+    ant->d = key & 3;
+    ant->state = key >> 2;
+}
+
+/*
+ * Runs n steps. The ant stays in registers for the whole batch, and headless
+ * runs do nothing else. With a pixel buffer, each cell left behind is painted
+ * as the ant goes, and the box around the cells visited is marked dirty once
+ * the batch is done.
+ */
+void run_steps(ant_t *ant, uint64_t n)
+{
+    if (unbounded)
+    {
+        run_page_steps(ant, n);
+        return;
+    }
+
+    int x = ant->x, y = ant->y;
+    size_t key = ant_key(ant->state, ant->d);
+    int64_t i = (int64_t)texture_w * y + x;
+
+    if (!pixels)
+    {
+        for (uint64_t k = 0; k < n; k++)
+            step_ant(x, y, key, i);
+    }
+    else if (n > 0)
+    {
+        int x0 = x, x1 = x, y0 = y, y1 = y;
+
+        for (uint64_t k = 0; k < n; k++)
+        {
+            int64_t last = i;
+
+            step_ant(x, y, key, i);
+            pixels[last] = states[cell_grid[last].state].hex;
+
+            x0 = x < x0 ? x : x0;
+            x1 = x > x1 ? x : x1;
+            y0 = y < y0 ? y : y0;
+            y1 = y > y1 ? y : y1;
+        }
+
+        pixels[i] = ANT_COLOR;
+        for (int row = y0; row <= y1; row++)
+        {
+            mark_dirty(x0, row);
+            mark_dirty(x1, row);
+        }
+    }
+
+    ant->x = x;
+    ant->y = y;
+    ant->d = key & 3;
+    ant->state = key >> 2;
+}
+
+/*
+ * Highways. A single ant is watched for WATCH_STEPS steps, first after
+ * MIN_INTERVAL steps, then after twice as many steps each time it was not on
+ * a highway, up to MAX_INTERVAL. If its trace over the watch, the position,
+ * direction, state and color read at every step, repeats with some period and
+ * displacement, the last period is kept as a footprint: every cell visited,
+ * relative to where the period started, with its color before and after the
+ * period.
+ *
+ * When every cell of the footprint, moved to where the ant stands, holds its
+ * color from before, the ant reads the same colors and takes the same path as
+ * in the footprint, and the period boils down to leaving the colors from after
+ * and moving the ant. A cell an earlier period visited holds what that period
+ * left, so whole runs of periods hang on the cells no period visited before,
+ * the new cells along the front of the highway. Where these lie outside the
+ * pages and the other trails, in the blank part of the unbounded world, they
+ * are known to be blank without reading them, and the ant skips every period
+ * up to the first one entering the box of the pages or of a trail at once.
+ * Otherwise the new cells are read a period at a time, until one of them is
+ * not as in the footprint: the ant has met something else, and steps again.
+ *
+ * The grid wraps around, and its highways run into their own trails once
+ * they crossed it. There, the trail is written to the grid as soon as it is
+ * skipped, before it would reach its own cells around the edges.
+ */
+#define MAX_PERIOD 2048
+#define WATCH_STEPS (2 * MAX_PERIOD)
+#define MIN_INTERVAL (1 << 13)
+#define MAX_INTERVAL (1 << 24)
+
+typedef struct {
+    int64_t x;
+    int64_t y;
+    size_t k;   /* Key, state and direction */
+    int s;      /* Color read */
+} trace_t;
+
+int highways = 1;
+uint64_t highway_steps = 0;         /* Steps skipped */
+uint64_t watch_interval = MIN_INTERVAL;
+uint64_t watch_countdown = MIN_INTERVAL; /* Steps until the next watch */
+
+trace_t trace[WATCH_STEPS + 1];
+
+/*
+ * The highway the ant is on, if period is not 0, with its footprint. Once the
+ * ant is phase steps into a period, it steps to the end of it before skipping
+ * again, and its trail in the unbounded world goes on in the same segment.
+ */
+footprint_t footprint[MAX_PERIOD];
+segment_t highway = { .cells = footprint };
+int period = 0;
+uint64_t phase = 0;
+size_t highway_key = 0;             /* Key of the ant starting a period */
+uint64_t highway_skipped = 0;       /* Steps skipped since it was found */
+int highway_segment = -1;           /* Its trail so far, -1 if none */
+
+/* Periods after which no cell is visited again, not as the footprint has it */
+int highway_depth = 0;
+int64_t highway_limit = 0;
+/* Whether its new cells are blank, and their bounding box */
+int highway_blank = 0;
+int fresh_x0 = 0, fresh_y0 = 0, fresh_x1 = 0, fresh_y1 = 0;
+
+/* Shortest difference of two coordinates around a wrapping edge of size n */
+int wrap_diff(int a, int b, int n)
+{
+    int d = (a - b) % n;
+
+    if (d > n / 2)
+        d -= n;
+    else if (d < -(n - 1) / 2)
+        d += n;
+    return d;
+}
+
+int wrap(int64_t a, int n)
+{
+    a %= n;
+    return a < 0 ? a + n : a;
+}
+
+/* Difference of two coordinates, around the edges of the grid if it has any */
+int coord_diff(int64_t a, int64_t b, int n)
+{
+    return unbounded ? (int)(a - b) : wrap_diff(a, b, n);
+}
+
+/* Color of the cell at x, y, wrapping around the edges of the grid */
+int color_at(int64_t x, int64_t y)
+{
+    if (unbounded)
+        return world_color(x, y);
+    return grid(wrap(x, texture_w), wrap(y, texture_h)).state;
+}
+
+int compare_footprints(const void *a, const void *b)
+{
+    int c = compare_cells(a, b);
+    return c ? c : ((const footprint_t *)a)->t - ((const footprint_t *)b)->t;
+}
+
+/* Steps the ant while recording its trace */
+void watch(ant_t *ant)
+{
+    if (unbounded)
+    {
+        for (int t = 0; t < WATCH_STEPS; t++)
+        {
+            trace[t] = (trace_t){ ant->x, ant->y,
+                ant_key(ant->state, ant->d), world_color(ant->x, ant->y) };
+            run_page_steps(ant, 1);
+        }
+        trace[WATCH_STEPS] = (trace_t){ ant->x, ant->y,
+            ant_key(ant->state, ant->d), 0 };
+        return;
+    }
+
+    int x = ant->x, y = ant->y;
+    size_t key = ant_key(ant->state, ant->d);
+    int64_t i = (int64_t)texture_w * y + x;
+
+    for (int t = 0; t < WATCH_STEPS; t++)
+    {
+        trace[t] = (trace_t){ x, y, key, cell_grid[i].state };
+        step_ant(x, y, key, i);
+        paint(trace[t].x, trace[t].y,
+            states[grid(trace[t].x, trace[t].y).state].hex);
+    }
+    trace[WATCH_STEPS] = (trace_t){ x, y, key, 0 };
+    paint(x, y, ANT_COLOR);
+
+    ant->x = x;
+    ant->y = y;
+    ant->d = key & 3;
+    ant->state = key >> 2;
+}
+
+/*
+ * Periods until the cell f of the footprint is visited again, moving it by
+ * the shift times -dir every period, 0 if it never is.
+ */
+int next_visit(const footprint_t *f, int dir)
+{
+    for (int d = 1; ; d++)
+    {
+        int x = f->x + d * dir * highway.sx;
+        int y = f->y + d * dir * highway.sy;
+
+        if (x < highway.x0 || x > highway.x1
+            || y < highway.y0 || y > highway.y1)
+            return 0;
+        if (footprint_cell(&highway, x, y))
+            return d;
+    }
+}
+
+/* Links the visits of the cells of the footprint from one period to the next */
+void link_footprint(void)
+{
+    highway.x0 = highway.x1 = footprint[0].x;
+    highway.y0 = highway.y1 = footprint[0].y;
+    for (int i = 1; i < highway.size; i++)
+    {
+        footprint_t *f = &footprint[i];
+        highway.x0 = f->x < highway.x0 ? f->x : highway.x0;
+        highway.x1 = f->x > highway.x1 ? f->x : highway.x1;
+        highway.y0 = f->y < highway.y0 ? f->y : highway.y0;
+        highway.y1 = f->y > highway.y1 ? f->y : highway.y1;
+    }
+
+    highway_depth = 0;
+    highway_limit = INT64_MAX;
+    highway_blank = 1;
+    fresh_x0 = highway.x1;
+    fresh_x1 = highway.x0;
+    fresh_y0 = highway.y1;
+    fresh_y1 = highway.y0;
+
+    for (int i = 0; i < highway.size; i++)
+    {
+        footprint_t *f = &footprint[i];
+        f->before = next_visit(f, 1);
+        f->after = next_visit(f, -1);
+
+        if (f->before == 0)
+        {
+            highway_blank = highway_blank && f->from == 0;
+            fresh_x0 = f->x < fresh_x0 ? f->x : fresh_x0;
+            fresh_x1 = f->x > fresh_x1 ? f->x : fresh_x1;
+            fresh_y0 = f->y < fresh_y0 ? f->y : fresh_y0;
+            fresh_y1 = f->y > fresh_y1 ? f->y : fresh_y1;
+            continue;
+        }
+
+        /* A cell left in another color than the next visit reads ends it */
+        footprint_t *g = footprint_cell(&highway,
+            f->x + f->before * highway.sx, f->y + f->before * highway.sy);
+        if (g->to != f->from && f->before < highway_limit)
+            highway_limit = f->before;
+        highway_depth = f->before > highway_depth ? f->before : highway_depth;
+    }
+}
+
+/*
+ * Looks for the shortest period of the trace, and keeps its footprint. On the
+ * grid, a period must stay shorter than half of it for the displacement to be
+ * told apart from wrapping around.
+ */
+int find_highway(void)
+{
+    int max = MAX_PERIOD;
+    if (!unbounded && max >= texture_w / 2)
+        max = (texture_w - 1) / 2;
+    if (!unbounded && max >= texture_h / 2)
+        max = (texture_h - 1) / 2;
+
+    const int end = WATCH_STEPS;
+
+    for (int p = 1; p <= max; p++)
+    {
+        if (trace[end].k != trace[end - p].k
+            || trace[end - 1].s != trace[end - 1 - p].s)
+            continue;
+
+        int sx = coord_diff(trace[end].x, trace[end - p].x, texture_w);
+        int sy = coord_diff(trace[end].y, trace[end - p].y, texture_h);
+        if (sx == 0 && sy == 0)
+            continue;
+
+        int t = end;
+        for (; t >= p; t--)
+            if (trace[t].k != trace[t - p].k
+                || (t < end && trace[t].s != trace[t - p].s)
+                || coord_diff(trace[t].x, trace[t - p].x, texture_w) != sx
+                || coord_diff(trace[t].y, trace[t - p].y, texture_h) != sy)
+                break;
+        if (t >= p)
+            continue;
+
+        /* The color before the period is the one read on the first step */
+        const trace_t *start = &trace[end - p];
+        for (int i = 0; i < p; i++)
+        {
+            const trace_t *step = &trace[end - p + i];
+            footprint[i] = (footprint_t){
+                .x = coord_diff(step->x, start->x, texture_w),
+                .y = coord_diff(step->y, start->y, texture_h),
+                .t = i,
+                .from = step->s
+            };
+        }
+        qsort(footprint, p, sizeof(footprint_t), compare_footprints);
+
+        highway.size = 0;
+        for (int i = 0; i < p; i++)
+        {
+            footprint_t *f = &footprint[i];
+            if (i > 0 && f->x == footprint[i - 1].x
+                && f->y == footprint[i - 1].y)
+                continue;
+            f->to = color_at(start->x + f->x, start->y + f->y);
+            footprint[highway.size++] = *f;
+        }
+
+        highway.sx = sx;
+        highway.sy = sy;
+        link_footprint();
+
+        period = p;
+        phase = 0;
+        highway_key = trace[end].k;
+        highway_skipped = 0;
+        highway_segment = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the cells period t of the highway reads from the world hold their
+ * colors from before. In the unbounded world, a segment only covers blank
+ * cells without a page, so any other cell read gets its page, where the trail
+ * will leave its color.
+ */
+int period_holds(int64_t t)
+{
+    for (int i = 0; i < highway.size; i++)
+    {
+        const footprint_t *f = &footprint[i];
+        if (f->before && f->before <= t)
+            continue;
+
+        int64_t x = highway.x + t * highway.sx + f->x;
+        int64_t y = highway.y + t * highway.sy + f->y;
+        int color;
+        if (!unbounded)
+            color = color_at(x, y);
+        else if (f->before || !highway_blank)
+            color = world(x, y).state;
+        else
+            color = world_color(x, y);
+
+        if (color != f->from)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Periods from t on, up to max, whose new cells all lie outside the box of the
+ * pages and the boxes of the trails.
+ */
+int64_t clear_periods(int64_t t, int64_t max)
+{
+    int64_t end = max;
+
+    for (int i = -1; i < num_segments; i++)
+    {
+        int64_t x0, y0, x1, y1;
+        if (i >= 0)
+            segment_box(&segments[i], &x0, &y0, &x1, &y1);
+        else if (num_pages == 0)
+            continue;
+        else
+        {
+            x0 = pages_x0 * PAGE_SIZE;
+            y0 = pages_y0 * PAGE_SIZE;
+            x1 = pages_x1 * PAGE_SIZE + PAGE_SIZE - 1;
+            y1 = pages_y1 * PAGE_SIZE + PAGE_SIZE - 1;
+        }
+
+        int64_t t0 = t, t1 = end;
+        clip_periods(highway.x, highway.sx, x0 - fresh_x1, x1 - fresh_x0,
+            &t0, &t1);
+        clip_periods(highway.y, highway.sy, y0 - fresh_y1, y1 - fresh_y0,
+            &t0, &t1);
+        if (t0 < t1)
+            end = t0;
+    }
+
+    return end - t;
+}
+
+/* Skips up to max periods from where the ant stands, returns how many */
+int64_t skip_periods(int64_t max)
+{
+    int64_t t = 0;
+
+    while (t < max)
+    {
+        int64_t k = 0;
+        if (unbounded && highway_blank && t >= highway_depth)
+            k = clear_periods(t, max);
+        if (k == 0)
+        {
+            if (!period_holds(t))
+                break;
+            k = 1;
+        }
+        t += k;
+    }
+
+    return t;
+}
+
+/* Writes the trail of count periods from where the ant stands to the grid */
+void write_trail(int64_t count)
+{
+    for (int i = 0; i < highway.size; i++)
+    {
+        const footprint_t *f = &footprint[i];
+        int64_t t = f->after && f->after < count ? count - f->after : 0;
+        int x = wrap(highway.x + t * highway.sx + f->x, texture_w);
+        int y = wrap(highway.y + t * highway.sy + f->y, texture_h);
+
+        for (; t < count; t++)
+        {
+            grid(x, y).state = f->to;
+            paint(x, y, states[f->to].hex);
+
+            x += highway.sx;
+            if ((unsigned)x >= (unsigned)texture_w)
+                x += x < 0 ? texture_w : -texture_w;
+            y += highway.sy;
+            if ((unsigned)y >= (unsigned)texture_h)
+                y += y < 0 ? texture_h : -texture_h;
+        }
+    }
+}
+
+/* Whether every cell of periods t0 up to t1 of a segment has its page */
+int segment_paged(const segment_t *s, int64_t t0, int64_t t1)
+{
+    for (int64_t t = t0; t < t1; t++)
+        for (int i = 0; i < s->size; i++)
+        {
+            int64_t x = s->x + t * s->sx + s->cells[i].x;
+            int64_t y = s->y + t * s->sy + s->cells[i].y;
+            if (!find_page(x >> PAGE_BITS, y >> PAGE_BITS))
+                return 0;
+        }
+    return 1;
+}
+
+/*
+ * Keeps the trail of count periods from where the ant stands in the unbounded
+ * world, and writes it to the pages already allocated. It goes on with the
+ * segment the highway left so far when the ant stepped the periods in between,
+ * which have their pages.
+ */
+void add_trail(int64_t count)
+{
+    segment_t *s = highway_segment >= 0 ? &segments[highway_segment] : NULL;
+    int64_t t0 = 0;
+
+    if (s)
+    {
+        t0 = highway.sx ? (highway.x - s->x) / highway.sx
+            : (highway.y - s->y) / highway.sy;
+        if (t0 < s->count || highway.x != s->x + t0 * highway.sx
+            || highway.y != s->y + t0 * highway.sy
+            || !segment_paged(s, s->count, t0))
+            s = NULL;
+    }
+
+    if (s)
+        s->count = t0 + count;
+    else
+    {
+        segments = (segment_t *)realloc(segments,
+            (num_segments + 1) * sizeof(segment_t));
+        s = &segments[num_segments];
+        *s = highway;
+        s->count = count;
+        s->cells = (footprint_t *)malloc(highway.size * sizeof(footprint_t));
+        memcpy(s->cells, footprint, highway.size * sizeof(footprint_t));
+        highway_segment = num_segments++;
+        t0 = 0;
+    }
+
+    int64_t t1 = s->count;
+    box_periods(s, pages_x0 * PAGE_SIZE, pages_y0 * PAGE_SIZE,
+        pages_x1 * PAGE_SIZE + PAGE_SIZE - 1,
+        pages_y1 * PAGE_SIZE + PAGE_SIZE - 1, &t0, &t1);
+    write_segment(s, t0, t1, NULL);
+}
+
+/* Skips whole periods of at most n steps, returns the number of steps */
+uint64_t fast_forward(ant_t *ant, uint64_t n)
+{
+    uint64_t skipped = 0;
+
+    if ((size_t)ant_key(ant->state, ant->d) != highway_key)
+        return 0;
+
+    /* On the grid, a trail must not reach its own cells around the edges */
+    int64_t lap = highway_limit;
+    if (!unbounded && highway.sx != 0)
+    {
+        int64_t k = (texture_w - 1 - (highway.x1 - highway.x0))
+            / abs(highway.sx) + 1;
+        lap = k < lap ? k : lap;
+    }
+    if (!unbounded && highway.sy != 0)
+    {
+        int64_t k = (texture_h - 1 - (highway.y1 - highway.y0))
+            / abs(highway.sy) + 1;
+        lap = k < lap ? k : lap;
+    }
+
+    while (n - skipped >= (uint64_t)period)
+    {
+        int64_t max = (n - skipped) / period < (uint64_t)lap
+            ? (int64_t)((n - skipped) / period) : lap;
+
+        highway.x = ant->x;
+        highway.y = ant->y;
+        int64_t count = skip_periods(max);
+        if (count == 0)
+            break;
+
+        if (unbounded)
+        {
+            add_trail(count);
+            ant->x += count * highway.sx;
+            ant->y += count * highway.sy;
+        }
+        else
+        {
+            write_trail(count);
+            ant->x = wrap(ant->x + count * highway.sx, texture_w);
+            ant->y = wrap(ant->y + count * highway.sy, texture_h);
+        }
+
+        skipped += count * period;
+        if (count < max)
+            break;
+    }
+
+    paint(ant->x, ant->y, ANT_COLOR);
+    highway_steps += skipped;
+
+    return skipped;
+}
+
+/* Runs n steps of a single ant, skipping along highways */
+void run(ant_t *ant, uint64_t n)
+{
+    while (n > 0 && highways)
+    {
+        /* On a highway, the ant only skips from the start of a period */
+        if (period > 0 && (phase > 0 || n < (uint64_t)period))
+        {
+            uint64_t k = period - phase < n ? period - phase : n;
+            run_steps(ant, k);
+            phase = (phase + k) % period;
+            n -= k;
+            continue;
+        }
+
+        if (period > 0)
+        {
+            uint64_t skipped = fast_forward(ant, n);
+            n -= skipped;
+            highway_skipped += skipped;
+
+            /* Out of steps on the highway, it goes on in the next run */
+            if (n < (uint64_t)period)
+                continue;
+
+            /*
+             * The ant met something else. A highway that skipped more steps
+             * than its watch took is watched for again soon, one that broke
+             * up right away is not.
+             */
+            if (highway_skipped >= WATCH_STEPS)
+                watch_interval = MIN_INTERVAL;
+            else if (watch_interval < MAX_INTERVAL)
+                watch_interval *= 2;
+            watch_countdown = watch_interval;
+            period = 0;
+            continue;
+        }
+
+        if (watch_countdown > 0 || n < WATCH_STEPS)
+        {
+            uint64_t k = watch_countdown > 0 && watch_countdown < n
+                ? watch_countdown : n;
+            run_steps(ant, k);
+            watch_countdown -= watch_countdown > 0 ? k : 0;
+            n -= k;
+            continue;
+        }
+
+        watch(ant);
+        n -= WATCH_STEPS;
+
+        if (!find_highway())
+        {
+            if (watch_interval < MAX_INTERVAL)
+                watch_interval *= 2;
+            watch_countdown = watch_interval;
+        }
+    }
+
+    run_steps(ant, n);
+}
+
+/*
+ * Swarms. With -a, many ants share the grid and step synchronously: every
+ * ant turns and takes its new state on the color its cell had at the start of
+ * the step, then the ants standing on a cell write their colors to it one
+ * after the other, in order of id, and the ants move. Ants are kept sorted by
+ * strip, then by id, and an ant only ever touches the cell it stands on, in
+ * its own strip, so the grid is split into horizontal strips stepped in
+ * parallel without threads ever contending. Moving one row, an ant can only
+ * cross into the strip above or below, and after every step each strip sends
+ * its ants up, keeps them, or sends them down. The ants a strip receives come
+ * in three runs sorted by id, merged back into one when the turmite has more
+ * than one state: with a single state every ant writes the same way, and the
+ * order does not matter.
+ */
+/* Ants per thread below which a swarm is stepped serially */
+#define SWARM_THREAD_ANTS 4096
+
+enum {
+    STRIP_UP,
+    STRIP_STAY,
+    STRIP_DOWN
+};
+
+ant_t *ants = NULL;         /* Sorted by strip */
+ant_t *ants_next = NULL;
+
+int num_strips = 1;
+int *strip_start = NULL;    /* Ants of strip s start at strip_start[s] */
+int *strip_next = NULL;
+int *strip_counts = NULL;   /* Ants leaving strip s in direction i, s * 3 + i */
+int *strip_offsets = NULL;
+
+#define strip_of(y) ((int)((int64_t)(y) * num_strips / texture_h))
+
+/* Where an ant in strip s goes */
+int strip_way(int s, int y)
+{
+    int t = strip_of(y);
+
+    if (t == s)
+        return STRIP_STAY;
+    return t == (s + num_strips - 1) % num_strips ? STRIP_UP : STRIP_DOWN;
+}
+
+void step_strip(int s)
+{
+    ant_t *first = &ants[strip_start[s]];
+    ant_t *last = &ants[strip_start[s + 1]];
+
+    for (ant_t *a = first; a < last; a++)
+    {
+        int64_t m =
+            transitions[ant_key(a->state, a->d)][grid(a->x, a->y).state];
+        a->d = move_key(m) & 3;
+        a->next = move_key(m) >> 2;
+    }
+
+    for (ant_t *a = first; a < last; a++)
+    {
+        cell_t *cell = &grid(a->x, a->y);
+        cell->state = rule(a->state, cell->state).color;
+        paint(a->x, a->y, states[cell->state].hex);
+        a->state = a->next;
+
+        a->x += dx[a->d];
+        a->y += dy[a->d];
+        if ((unsigned)a->x >= (unsigned)texture_w)
+            a->x = a->x < 0 ? texture_w - 1 : 0;
+        if ((unsigned)a->y >= (unsigned)texture_h)
+            a->y = a->y < 0 ? texture_h - 1 : 0;
+
+        strip_counts[s * 3 + strip_way(s, a->y)]++;
+    }
+}
+
+/* Lays out the strips of the next step from the ants leaving each strip */
+void place_strips(void)
+{
+    int n = 0;
+
+    for (int t = 0; t < num_strips; t++)
+    {
+        int up = (t + num_strips - 1) % num_strips;
+        int down = (t + 1) % num_strips;
+
+        /* From the strip above, then from t itself, then from below */
+        strip_next[t] = n;
+        strip_offsets[up * 3 + STRIP_DOWN] = n;
+        n += strip_counts[up * 3 + STRIP_DOWN];
+        strip_offsets[t * 3 + STRIP_STAY] = n;
+        n += strip_counts[t * 3 + STRIP_STAY];
+        strip_offsets[down * 3 + STRIP_UP] = n;
+        n += strip_counts[down * 3 + STRIP_UP];
+    }
+    strip_next[num_strips] = n;
+
+    memset(strip_counts, 0, num_strips * 3 * sizeof(int));
+}
+
+void move_strip(int s)
+{
+    for (int i = strip_start[s]; i < strip_start[s + 1]; i++)
+        ants_next[strip_offsets[s * 3 + strip_way(s, ants[i].y)]++] = ants[i];
+}
+
+/* Merges the runs of ants strip t received back into ants, by id */
+void merge_strip(int t)
+{
+    int up = (t + num_strips - 1) % num_strips;
+    int a = strip_next[t], a_end = strip_offsets[up * 3 + STRIP_DOWN];
+    int b = a_end, b_end = strip_offsets[t * 3 + STRIP_STAY];
+    int c = b_end, c_end = strip_next[t + 1];
+
+    for (int i = strip_next[t]; i < c_end; i++)
+    {
+        int *from = a < a_end ? &a : b < b_end ? &b : &c;
+        if (b < b_end && ants_next[b].id < ants_next[*from].id)
+            from = &b;
+        if (c < c_end && ants_next[c].id < ants_next[*from].id)
+            from = &c;
+        ants[i] = ants_next[(*from)++];
+    }
+}
+
+/* The strips and ants of the next step become those of the current one */
+void swap_strips(void)
+{
+    if (NUM_ANT_STATES == 1)
+    {
+        ant_t *a = ants;
+        ants = ants_next;
+        ants_next = a;
+    }
+
+    int *start = strip_start;
+    strip_start = strip_next;
+    strip_next = start;
+}
+
+/*
+ * Runs n steps of the swarm, then paints the ants. A parallel step takes four
+ * barriers, which cost more than stepping a few thousand ants, so smaller
+ * swarms are stepped by the calling thread alone.
+ */
+void run_swarm(uint64_t n)
+{
+    if (num_ants < SWARM_THREAD_ANTS * omp_get_max_threads())
+    {
+        for (uint64_t k = 0; k < n; k++)
+        {
+            for (int s = 0; s < num_strips; s++)
+                step_strip(s);
+            place_strips();
+            for (int s = 0; s < num_strips; s++)
+                move_strip(s);
+            if (NUM_ANT_STATES > 1)
+                for (int s = 0; s < num_strips; s++)
+                    merge_strip(s);
+            swap_strips();
+        }
+    }
+    else
+    {
+        #pragma omp parallel
+        for (uint64_t k = 0; k < n; k++)
+        {
+            #pragma omp for schedule(dynamic)
+            for (int s = 0; s < num_strips; s++)
+                step_strip(s);
+
+            #pragma omp single
+            place_strips();
+
+            #pragma omp for schedule(dynamic)
+            for (int s = 0; s < num_strips; s++)
+                move_strip(s);
+
+            if (NUM_ANT_STATES > 1)
+            {
+                #pragma omp for schedule(dynamic)
+                for (int s = 0; s < num_strips; s++)
+                    merge_strip(s);
+            }
+
+            #pragma omp single
+            swap_strips();
+        }
+    }
+
+    for (int i = 0; i < num_ants; i++)
+        paint(ants[i].x, ants[i].y, ANT_COLOR);
+}
+
+/*
+ * Scatters the ants over the grid, facing random directions, and sorts them
+ * by strip. There are a few strips per thread for balance, and at least three
+ * unless there is one, so that the strips above and below differ.
+ */
+void init_swarm(void)
+{
+    ants = (ant_t *)malloc(num_ants * sizeof(ant_t));
+    ants_next = (ant_t *)malloc(num_ants * sizeof(ant_t));
+
+    num_strips = 4 * omp_get_max_threads();
+    if (num_strips > texture_h)
+        num_strips = texture_h;
+    if (num_strips < 3)
+        num_strips = 1;
+
+    strip_start = (int *)malloc((num_strips + 1) * sizeof(int));
+    strip_next = (int *)malloc((num_strips + 1) * sizeof(int));
+    strip_counts = (int *)calloc(num_strips * 3, sizeof(int));
+    strip_offsets = (int *)malloc(num_strips * 3 * sizeof(int));
+
+    for (int i = 0; i < num_ants; i++)
+    {
+        /* One draw per statement, the order is fixed for a given seed */
+        int x = rand() % texture_w;
+        int y = rand() % texture_h;
+        int d = rand() % 4;
+
+        ants_next[i] = (ant_t){ .x = x, .y = y, .d = d, .state = 0, .id = i };
+        strip_counts[strip_of(ants_next[i].y) * 3 + STRIP_STAY]++;
+    }
+
+    /* Nobody moves, place_strips() just sorts */
+    place_strips();
+    memcpy(strip_start, strip_next, (num_strips + 1) * sizeof(int));
+    for (int i = 0; i < num_ants; i++)
+    {
+        int s = strip_of(ants_next[i].y);
+        ants[strip_offsets[s * 3 + STRIP_STAY]++] = ants_next[i];
+        paint(ants_next[i].x, ants_next[i].y, ANT_COLOR);
+    }
+}
+
+/*
+ * Viewport of the unbounded world. The pixel buffer shows as many cells as
+ * the grid would have around the ant, and moves to put the ant back in the
+ * middle once it comes within a quarter of an edge. With -F, it shows the
+ * bounding box of the pages and trails instead, one cell out of every
+ * view_scale along each axis, as few as let the box fit. A thin trail would
+ * fall between the cells shown, so a blank one is shown as PAGE_COLOR when its
+ * page was visited or a trail runs by it. Either way the whole view is drawn
+ * again after every batch.
+ */
+int view_fit = 0;
+int64_t view_x = 0, view_y = 0; /* Cell in the top left corner */
+int64_t view_scale = 1;
+
+/* Whether a trail runs through the box */
+int trail_in(int64_t x0, int64_t y0, int64_t x1, int64_t y1)
+{
+    for (int i = 0; i < num_segments; i++)
+    {
+        int64_t t0 = 0, t1 = segments[i].count;
+        box_periods(&segments[i], x0, y0, x1, y1, &t0, &t1);
+        if (t0 < t1)
+            return 1;
+    }
+    return 0;
+}
+
+void draw_view(ant_t *ant)
+{
+    if (view_fit)
+    {
+        int64_t x0 = pages_x0 * PAGE_SIZE, y0 = pages_y0 * PAGE_SIZE;
+        int64_t x1 = pages_x1 * PAGE_SIZE + PAGE_SIZE - 1;
+        int64_t y1 = pages_y1 * PAGE_SIZE + PAGE_SIZE - 1;
+        for (int i = 0; i < num_segments; i++)
+        {
+            int64_t sx0, sy0, sx1, sy1;
+            segment_box(&segments[i], &sx0, &sy0, &sx1, &sy1);
+            x0 = sx0 < x0 ? sx0 : x0;
+            y0 = sy0 < y0 ? sy0 : y0;
+            x1 = sx1 > x1 ? sx1 : x1;
+            y1 = sy1 > y1 ? sy1 : y1;
+        }
+
+        int64_t w = x1 - x0 + 1, h = y1 - y0 + 1;
+        int64_t scale_h = (h + texture_h - 1) / texture_h;
+        view_scale = (w + texture_w - 1) / texture_w;
+        view_scale = scale_h > view_scale ? scale_h : view_scale;
 
-#define N 0
-#define E 90
-#define S 180
-#define W 270
+        /* Centered on the box */
+        view_x = x0 - (texture_w * view_scale - w) / 2;
+        view_y = y0 - (texture_h * view_scale - h) / 2;
+    }
+    else if (ant->x < view_x + texture_w / 4
+        || ant->x >= view_x + texture_w - texture_w / 4
+        || ant->y < view_y + texture_h / 4
+        || ant->y >= view_y + texture_h - texture_h / 4)
+    {
+        view_x = ant->x - texture_w / 2;
+        view_y = ant->y - texture_h / 2;
+    }
 
-#define ANT_COLOR 0xff4040ff
+    for (int y = 0; y < texture_h; y++)
+    {
+        for (int x = 0; x < texture_w; x++)
+        {
+            int64_t wx = view_x + x * view_scale;
+            int64_t wy = view_y + y * view_scale;
+            int color = world_color(wx, wy);
 
-#define SCALE 4
-#define WIDTH 800
-#define HEIGHT 600
+            pixel(x, y) = !color && view_scale > 1
+                && (find_page(wx >> PAGE_BITS, wy >> PAGE_BITS)
+                    || trail_in(wx, wy, wx + view_scale - 1,
+                        wy + view_scale - 1))
+                ? PAGE_COLOR : states[color].hex;
+        }
+        dirty_x0[y] = 0;
+        dirty_x1[y] = texture_w;
+    }
 
-typedef uint32_t pixel_t;
+    int64_t x = (ant->x - view_x) / view_scale;
+    int64_t y = (ant->y - view_y) / view_scale;
+    if (ant->x >= view_x && x < texture_w && ant->y >= view_y && y < texture_h)
+        pixel(x, y) = ANT_COLOR;
+}
 
-typedef struct {
-    /* State value corresponding to 'id' in state_t */
-    int state;
-} cell_t;
+/* Runs n steps of the ant or of the swarm */
+void run_ants(uint64_t n)
+{
+    if (num_ants > 1)
+        run_swarm(n);
+    else
+        run(ant, n);
 
-typedef struct {
-    int x;
-    int y;
-    int d;
-} ant_t;
+    if (unbounded && pixels)
+        draw_view(ant);
+}
 
-typedef struct {
-    pixel_t hex;
-    char motion;
-    int id;
-} state_t;
+double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-int NUM_STATES = 0;
+/*
+ * Frame export. With -R, the pixel buffer is copied into a bounded queue every
+ * -I steps, and a writer thread turns the queued frames into one Y4M video, or
+ * into a sequence of PPM images. A headless run waits for the writer when the
+ * queue is full, so that every frame is written. With a window, the simulation
+ * has a display to keep up with instead: the frame is dropped, and dropped
+ * frames are counted.
+ *
+ * This block is the same in all four programs but for the copy of the pixel
+ * buffer in export_frame(), and is best changed in all of them at once.
+ */
+#define EXPORT_QUEUE 16
 
-char *rules = NULL;
+char *export_path = NULL;
+int export_y4m = 0;
+uint64_t export_interval = 1;
+uint64_t export_steps = 0;
+uint64_t export_written = 0;
+uint64_t export_dropped = 0;
+int export_failed = 0;
 
-state_t *states = NULL;
+pixel_t *export_queue[EXPORT_QUEUE];
+uint64_t export_numbers[EXPORT_QUEUE]; /* Step of each queued frame */
+int export_head = 0;    /* Oldest queued frame */
+int export_count = 0;
+int export_done = 0;
+SDL_mutex *export_lock = NULL;
+SDL_cond *export_cond = NULL;
+SDL_Thread *export_thread = NULL;
+FILE *export_file = NULL;
+uint8_t *export_bytes = NULL;
 
-cell_t *cell_grid = NULL;
+/* Writes one frame as RGB, or as the three planes of a Y4M frame (BT.601) */
+int write_frame(pixel_t *frame, uint64_t number)
+{
+    size_t cells = (size_t)texture_w * texture_h;
 
-pixel_t *pixels = NULL;
+    for (size_t i = 0; i < cells; i++)
+    {
+        int r = frame[i] >> 24;
+        int g = (frame[i] >> 16) & 0xff;
+        int b = (frame[i] >> 8) & 0xff;
 
-ant_t *ant = NULL;
+        if (export_y4m)
+        {
+            export_bytes[i] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+            export_bytes[cells + i] =
+                128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            export_bytes[2 * cells + i] =
+                128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+        }
+        else
+        {
+            export_bytes[3 * i] = r;
+            export_bytes[3 * i + 1] = g;
+            export_bytes[3 * i + 2] = b;
+        }
+    }
 
-int window_w  = WIDTH,
-    window_h  = HEIGHT;
+    if (export_y4m)
+        return fputs("FRAME\n", export_file) == EOF
+            || fwrite(export_bytes, 3, cells, export_file) != cells ? -1 : 0;
 
-/* SCALE must divide window dimensions */
-int texture_w = WIDTH / SCALE,
-    texture_h = HEIGHT / SCALE;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%06llu.ppm", export_path,
+        (unsigned long long)number);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "P6\n%d %d\n255\n", texture_w, texture_h);
+    int ok = fwrite(export_bytes, 3, cells, f) == cells;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
 
-SDL_Window *window = NULL;
-SDL_Renderer *renderer = NULL;
-SDL_Texture *texture = NULL;
+int export_writer(void *data)
+{
+    (void)data;
+
+    SDL_LockMutex(export_lock);
+    for (;;)
+    {
+        while (export_count == 0 && !export_done)
+            SDL_CondWait(export_cond, export_lock);
+        if (export_count == 0)
+            break;
 
-#define grid(x, y) cell_grid[(texture_w * (y)) + (x)]
-#define pixel(x, y) pixels[(texture_w * (y)) + (x)]
+        /* The simulation never touches queued frames */
+        pixel_t *frame = export_queue[export_head];
+        uint64_t number = export_numbers[export_head];
+        SDL_UnlockMutex(export_lock);
 
-pixel_t rcolor(void)
+        if (!export_failed && write_frame(frame, number) == -1)
+        {
+            fprintf(stderr, "[ERROR] Could not write frame %llu to '%s'\n",
+                (unsigned long long)number, export_path);
+            export_failed = 1;
+        }
+        else if (!export_failed)
+        {
+            export_written++;
+        }
+
+        SDL_LockMutex(export_lock);
+        export_head = (export_head + 1) % EXPORT_QUEUE;
+        export_count--;
+        SDL_CondSignal(export_cond);
+    }
+    SDL_UnlockMutex(export_lock);
+
+    return 0;
+}
+
+int export_start(void)
 {
-    char *hex = "0123456789abcdef";
-    char color[9];
-    memset(color, 'f', 8);
+    size_t len = strlen(export_path);
+    export_y4m = len > 4 && strcmp(export_path + len - 4, ".y4m") == 0;
 
-    int i = (rand() % 3) * 2;
-    color[i] = hex[rand() % 16];
-    color[i + 1] = hex[rand() % 16];
-    i =  (rand() % 3) * 2;
-    color[i] = '4';
-    color[i + 1] = '0';
+    if (export_y4m)
+    {
+        export_file = fopen(export_path, "wb");
+        if (export_file == NULL)
+        {
+            fprintf(stderr, "[ERROR] Could not open '%s'\n", export_path);
+            return -1;
+        }
+        fprintf(export_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+            texture_w, texture_h, FPS);
+    }
 
-    return (pixel_t)strtol(color, NULL, 16);
+    size_t cells = (size_t)texture_w * texture_h;
+    for (int i = 0; i < EXPORT_QUEUE; i++)
+        export_queue[i] = (pixel_t *)malloc(cells * sizeof(pixel_t));
+    export_bytes = (uint8_t *)malloc(cells * 3);
+
+    export_lock = SDL_CreateMutex();
+    export_cond = SDL_CreateCond();
+    export_thread = SDL_CreateThread(export_writer, "export", NULL);
+
+    return 0;
+}
+
+/* Queues the pixel buffer on every export_interval-th call */
+void export_frame(void)
+{
+    if (!export_path || export_steps++ % export_interval)
+        return;
+
+    /* Without a window, nothing is lost by waiting for a slot */
+    SDL_LockMutex(export_lock);
+    while (export_count == EXPORT_QUEUE && !window)
+        SDL_CondWait(export_cond, export_lock);
+    int tail = (export_head + export_count) % EXPORT_QUEUE;
+    int full = export_count == EXPORT_QUEUE;
+    SDL_UnlockMutex(export_lock);
+
+    if (full)
+    {
+        export_dropped++;
+        return;
+    }
+
+    memcpy(export_queue[tail], pixels,
+        (size_t)texture_w * texture_h * sizeof(pixel_t));
+    export_numbers[tail] = export_steps - 1;
+
+    SDL_LockMutex(export_lock);
+    export_count++;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+}
+
+/* Writes the queued frames and stops the writer */
+void export_stop(void)
+{
+    if (!export_path)
+        return;
+
+    SDL_LockMutex(export_lock);
+    export_done = 1;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+    SDL_WaitThread(export_thread, NULL);
+
+    if (export_file)
+        fclose(export_file);
+    fprintf(stderr, "Exported %llu frames, dropped %llu\n",
+        (unsigned long long)export_written,
+        (unsigned long long)export_dropped);
 }
 
-/* Rotate within range [0, 360) */
-void rotate(ant_t *ant, int motion)
+/*
+ * Runs n steps in batches, cut at the steps recorded with -R. A frame is queued
+ * once every -I steps, as if export_frame() were called after every step.
+ */
+void advance(uint64_t n)
 {
-    switch (motion)
+    if (!export_path)
+    {
+        run_ants(n);
+        return;
+    }
+
+    while (n > 0)
     {
-    case 'L':
-        ant->d -= 90;
-        if (ant->d < 0)
-            ant->d = 360 + ant->d;
-        break;
-    case 'R':
-        ant->d += 90;
-        if (ant->d >= 360)
-            ant->d = 0;
-        break;
+        /* export_steps - 1 steps were taken so far */
+        uint64_t k = export_interval - (export_steps - 1) % export_interval;
+        if (k > n)
+            k = n;
+
+        run_ants(k);
+        export_steps += k - 1;
+        export_frame();
+        n -= k;
     }
 }
 
-/* Move one cell in current direction, wrapping world edges */
-void move(ant_t *ant)
+/*
+ * Checksum of the unbounded world: the sum, over its cells holding any color
+ * but 0, of a hash of the color times CHECKSUM_A to the x times CHECKSUM_B to
+ * the y, modulo the prime 2^61 - 1. Along a trail, the terms of a cell of the
+ * footprint make a geometric series, summed without writing the trail. Pages
+ * hold the colors of the trails running through them, and what they hold is
+ * summed instead.
+ */
+#define CHECKSUM_PRIME ((1ULL << 61) - 1)
+#define CHECKSUM_A 0x1d8e4e27c47d124fULL
+#define CHECKSUM_B 0x0f3c6f7e8a91b2d5ULL
+
+uint64_t add_mod(uint64_t a, uint64_t b)
+{
+    a += b;
+    return a >= CHECKSUM_PRIME ? a - CHECKSUM_PRIME : a;
+}
+
+/* a * b modulo the prime, in halves of 31 and 30 bits */
+uint64_t mul_mod(uint64_t a, uint64_t b)
+{
+    uint64_t a1 = a >> 31, a0 = a & 0x7fffffff;
+    uint64_t b1 = b >> 31, b0 = b & 0x7fffffff;
+    uint64_t mid = a1 * b0 + a0 * b1;
+    uint64_t c = (a1 * b1 << 1) + (mid >> 30) + ((mid & 0x3fffffff) << 31)
+        + a0 * b0;
+
+    c = (c & CHECKSUM_PRIME) + (c >> 61);
+    c = (c & CHECKSUM_PRIME) + (c >> 61);
+    return c >= CHECKSUM_PRIME ? c - CHECKSUM_PRIME : c;
+}
+
+/* a to the e modulo the prime, which is a to the e modulo the prime - 1 */
+uint64_t pow_mod(uint64_t a, int64_t e)
+{
+    int64_t m = (int64_t)(CHECKSUM_PRIME - 1);
+    uint64_t k = e % m < 0 ? e % m + m : e % m;
+    uint64_t p = 1;
+
+    for (; k > 0; k >>= 1, a = mul_mod(a, a))
+        if (k & 1)
+            p = mul_mod(p, a);
+    return p;
+}
+
+/* 1 + r + ... + r^(n - 1) modulo the prime */
+uint64_t geometric(uint64_t r, uint64_t n)
 {
-    switch (ant->d)
+    uint64_t sum = 0, power = 1;
+
+    for (int b = 63; b >= 0; b--)
     {
-    case N:
-        ant->y -= 1;
-        if (ant->y < 0)
-            ant->y = texture_h - 1;
-        break;
-    case E:
-        ant->x += 1;
-        if (ant->x >= texture_w)
-            ant->x = 0;
-        break;
-    case S:
-        ant->y += 1;
-        if (ant->y >= texture_h)
-            ant->y = 0;
-        break;
-    case W:
-        ant->x -= 1;
-        if (ant->x < 0)
-            ant->x = texture_w - 1;
-        break;
+        sum = mul_mod(sum, add_mod(1, power));
+        power = mul_mod(power, power);
+        if (n >> b & 1)
+        {
+            sum = add_mod(1, mul_mod(r, sum));
+            power = mul_mod(power, r);
+        }
     }
+    return sum;
 }
 
-void init(ant_t *ant, int d, SDL_Texture *texture)
+uint64_t color_hash[MAX_STATES];
+uint64_t row_terms[MAX_STATES][PAGE_SIZE];  /* Hash times CHECKSUM_A to x */
+uint64_t column_terms[PAGE_SIZE];           /* CHECKSUM_B to y */
+
+uint64_t page_sum(const page_t *page)
 {
-    NUM_STATES = strlen(rules);
-    states = (state_t *)malloc(NUM_STATES * sizeof(state_t));
+    uint64_t sum = 0;
 
-    if (NUM_STATES == 2)
+    for (int y = 0; y < PAGE_SIZE; y++)
     {
-        state_t color = (state_t){
-            .hex = 0xffffffff,
-            .motion = rules[0],
-            .id = 0
-        };
-        states[0] = color;
-        color = (state_t){
-            .hex = 0x404040ff,
-            .motion = rules[1],
-            .id = 1
-        };
-        states[1] = color;
+        const cell_t *row = &page->cells[y * PAGE_SIZE];
+        uint64_t row_sum = 0;
+        for (int x = 0; x < PAGE_SIZE; x++)
+            row_sum = add_mod(row_sum, row_terms[row[x].state][x]);
+        sum = add_mod(sum, mul_mod(row_sum, column_terms[y]));
+    }
+
+    return mul_mod(sum, mul_mod(pow_mod(CHECKSUM_A, page->x * PAGE_SIZE),
+        pow_mod(CHECKSUM_B, page->y * PAGE_SIZE)));
+}
+
+uint64_t segment_sum(const segment_t *s)
+{
+    uint64_t r = mul_mod(pow_mod(CHECKSUM_A, s->sx),
+        pow_mod(CHECKSUM_B, s->sy));
+    uint64_t sum = 0;
+
+    for (int i = 0; i < s->size; i++)
+    {
+        const footprint_t *f = &s->cells[i];
+        if (f->to == 0)
+            continue;
+
+        /* Periods after the last but f->after leave the cell to a later one */
+        int64_t t = f->after && f->after < s->count ? s->count - f->after : 0;
+        uint64_t first = mul_mod(mul_mod(color_hash[f->to],
+            pow_mod(CHECKSUM_A, s->x + f->x)),
+            mul_mod(pow_mod(CHECKSUM_B, s->y + f->y), pow_mod(r, t)));
+        sum = add_mod(sum, mul_mod(first, geometric(r, s->count - t)));
+    }
+
+    return sum;
+}
+
+uint64_t world_checksum(void)
+{
+    static page_t trail_page;
+    uint64_t sum = 0;
+
+    for (int c = 0; c < NUM_STATES; c++)
+    {
+        color_hash[c] = c ? c * 0x9e3779b97f4a7c15ULL % CHECKSUM_PRIME : 0;
+        for (int x = 0; x < PAGE_SIZE; x++)
+            row_terms[c][x] = mul_mod(color_hash[c], pow_mod(CHECKSUM_A, x));
     }
+    for (int y = 0; y < PAGE_SIZE; y++)
+        column_terms[y] = pow_mod(CHECKSUM_B, y);
+
+    for (size_t b = 0; b < num_buckets; b++)
+        for (page_t *page = buckets[b]; page; page = page->next)
+        {
+            sum = add_mod(sum, page_sum(page));
+
+            /* Less what the trails through the page would add */
+            for (int i = 0; i < num_segments; i++)
+            {
+                int64_t t0 = 0, t1 = segments[i].count;
+                box_periods(&segments[i], page->x * PAGE_SIZE,
+                    page->y * PAGE_SIZE, page->x * PAGE_SIZE + PAGE_SIZE - 1,
+                    page->y * PAGE_SIZE + PAGE_SIZE - 1, &t0, &t1);
+                if (t0 >= t1)
+                    continue;
+
+                trail_page.x = page->x;
+                trail_page.y = page->y;
+                memset(trail_page.cells, 0, sizeof(trail_page.cells));
+                write_segment(&segments[i], t0, t1, &trail_page);
+                sum = add_mod(sum, CHECKSUM_PRIME - page_sum(&trail_page));
+            }
+        }
+
+    for (int i = 0; i < num_segments; i++)
+        sum = add_mod(sum, segment_sum(&segments[i]));
+
+    return sum;
+}
+
+/* Runs n steps without rendering and prints one line of JSON */
+void benchmark(uint64_t n, uint64_t seed)
+{
+    double wall = wall_time();
+    clock_t cpu = clock();
+
+    advance(n);
+
+    double cpu_s = (double)(clock() - cpu) / CLOCKS_PER_SEC;
+    double wall_s = wall_time() - wall;
+
+    /* The first ant, wherever the swarm sorted it */
+    ant_t *first = ant;
+    for (int i = 0; i < num_ants && num_ants > 1; i++)
+        if (ants[i].id == 0)
+            first = &ants[i];
+
+    uint64_t checksum = 0xcbf29ce484222325;
+    if (unbounded)
+        checksum = world_checksum();
     else
+        for (int y = 0; y < texture_h; y++)
+            for (int x = 0; x < texture_w; x++)
+                checksum = (checksum ^ grid(x, y).state) * 0x100000001b3;
+
+    printf("{\"program\": \"sdl-la\", \"rules\": \"%s\", "
+        "\"width\": %d, \"height\": %d, \"ants\": %d, \"threads\": %d, "
+        "\"seed\": %llu, \"steps\": %llu, "
+        "\"wall_s\": %.6f, \"cpu_s\": %.6f, "
+        "\"steps_per_s\": %.3f, \"cell_updates_per_s\": %.3f, "
+        "\"highway_steps\": %llu, \"pages\": %llu, "
+        "\"x\": %lld, \"y\": %lld, \"checksum\": \"%016llx\"}\n",
+        rules, texture_w, texture_h, num_ants, omp_get_max_threads(),
+        (unsigned long long)seed, (unsigned long long)n,
+        wall_s, cpu_s, n / wall_s, (double)n * num_ants / wall_s,
+        (unsigned long long)highway_steps, (unsigned long long)num_pages,
+        (long long)first->x, (long long)first->y,
+        (unsigned long long)checksum);
+}
+
+/*
+ * Frames go from the simulation thread to the main thread through a lock-free
+ * triple buffer. The simulation thread owns the back buffer, the main thread
+ * the front one, and the middle one is exchanged atomically by both. A frame
+ * is published after every step, replacing the middle one if the main thread
+ * has not taken it yet, and FRAME_FRESH tells whether it did.
+ *
+ * A frame only carries the rectangles repainted since the last frame the main
+ * thread took, so that whichever frame it takes brings the texture in sync
+ * with the pixel buffer. Their pixels sit at the same place as in the pixel
+ * buffer, the rest of the frame buffer is stale and never read. The simulation
+ * keeps what it repainted since the previous frame apart, and folds it into
+ * what the next frame carries until a frame it published was taken.
+ */
+#define FRAME_FRESH 4
+#define MAX_RECTS 64
+
+typedef struct {
+    pixel_t *pixels;
+    SDL_Rect rects[MAX_RECTS];
+    int num_rects;
+} frame_t;
+
+frame_t frames[3];
+int frame_back = 0;     /* Simulation thread */
+int frame_front = 1;    /* Main thread */
+SDL_atomic_t frame_middle;
+
+SDL_atomic_t quit;
+
+/*
+ * Merges the spans repainted since the last frame taken into one rectangle per
+ * band of rows. Returns 0 if nothing was repainted since the previous frame.
+ */
+int collect_rects(frame_t *frame)
+{
+    int band = texture_h / MAX_RECTS + 1 > 16 ? texture_h / MAX_RECTS + 1 : 16;
+    int repainted = 0;
+
+    frame->num_rects = 0;
+    for (int y0 = 0; y0 < texture_h; y0 += band)
     {
-        for (int i = 0; i < NUM_STATES; i++)
+        int x0 = texture_w, x1 = 0, y1 = y0, ya = -1;
+
+        for (int y = y0; y < y0 + band && y < texture_h; y++)
         {
-            state_t color = (state_t){
-                .hex = rcolor(),
-                .motion = rules[i],
-                .id = i
-            };
-            states[i] = color;
+            repainted |= dirty_x0[y] < dirty_x1[y];
+
+            int a = dirty_x0[y] < sent_x0[y] ? dirty_x0[y] : sent_x0[y];
+            int b = dirty_x1[y] > sent_x1[y] ? dirty_x1[y] : sent_x1[y];
+            if (a >= b)
+                continue;
+            if (ya < 0)
+                ya = y;
+            y1 = y + 1;
+            x0 = a < x0 ? a : x0;
+            x1 = b > x1 ? b : x1;
         }
+
+        if (ya >= 0)
+            frame->rects[frame->num_rects++] =
+                (SDL_Rect){ x0, ya, x1 - x0, y1 - ya };
     }
 
-    ant->x = texture_w / 2;
-    ant->y = texture_h / 2;
-    ant->d = d;
+    return repainted;
+}
 
-    grid(ant->x, ant->y).state = 0;
-    pixel(ant->x, ant->y) = ANT_COLOR;
+void publish_frame(void)
+{
+    frame_t *frame = &frames[frame_back];
+    if (!collect_rects(frame))
+        return;
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy(&frame->pixels[(size_t)texture_w * y + r->x],
+                &pixels[(size_t)texture_w * y + r->x], r->w * sizeof(pixel_t));
+    }
+
+    SDL_MemoryBarrierRelease();
+    int old = SDL_AtomicSet(&frame_middle, frame_back | FRAME_FRESH);
+    frame_back = old & 3;
+
+    /* Once the previous frame was taken, only this one may still be lost */
+    for (int y = 0; y < texture_h; y++)
+    {
+        if (old & FRAME_FRESH)
+        {
+            sent_x0[y] = dirty_x0[y] < sent_x0[y] ? dirty_x0[y] : sent_x0[y];
+            sent_x1[y] = dirty_x1[y] > sent_x1[y] ? dirty_x1[y] : sent_x1[y];
+        }
+        else
+        {
+            sent_x0[y] = dirty_x0[y];
+            sent_x1[y] = dirty_x1[y];
+        }
+        dirty_x0[y] = texture_w;
+        dirty_x1[y] = 0;
+    }
 }
 
-void iterate(ant_t *ant, SDL_Texture *texture)
+/* Uploads the newest frame, if one was published since the last call */
+void upload_frame(void)
 {
-    cell_t *cell = &grid(ant->x, ant->y);
-    rotate(ant, states[cell->state].motion);
-    cell->state = (cell->state + 1) % NUM_STATES;
-    pixel(ant->x, ant->y) = states[cell->state].hex;
-    move(ant);
-    pixel(ant->x, ant->y) = ANT_COLOR;
+    if (!(SDL_AtomicGet(&frame_middle) & FRAME_FRESH))
+        return;
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+    frame_front = SDL_AtomicSet(&frame_middle, frame_front) & 3;
+    SDL_MemoryBarrierAcquire();
+
+    frame_t *frame = &frames[frame_front];
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        void *texels;
+        int pitch;
+
+        if (SDL_LockTexture(texture, r, &texels, &pitch) < 0)
+            continue;
+        for (int y = 0; y < r->h; y++)
+            memcpy((char *)texels + (size_t)pitch * y,
+                &frame->pixels[(size_t)texture_w * (r->y + y) + r->x],
+                r->w * sizeof(pixel_t));
+        SDL_UnlockTexture(texture);
+    }
+}
+
+/*
+ * Steps the ant in batches between frames. With -n, every frame shows exactly
+ * that many more steps, otherwise the batch doubles or halves to last about
+ * BATCH_TIME, long enough for the loop to stay tight and short enough to keep
+ * publishing frames and to quit promptly.
+ */
+#define BATCH_TIME 0.001
+
+int simulate(void *data)
+{
+    (void)data;
+
+    uint64_t batch = 1;
+
+    while (!SDL_AtomicGet(&quit))
+    {
+        if (frame_steps > 0)
+        {
+            /* Wait for the last frame to be taken */
+            while (SDL_AtomicGet(&frame_middle) & FRAME_FRESH
+                && !SDL_AtomicGet(&quit))
+                SDL_Delay(1);
+
+            advance(frame_steps);
+            publish_frame();
+            continue;
+        }
+
+        double start = wall_time();
+        advance(batch);
+        publish_frame();
+
+        double elapsed = wall_time() - start;
+        if (elapsed < BATCH_TIME / 2)
+            batch *= 2;
+        else if (elapsed > BATCH_TIME * 2 && batch > 1)
+            batch /= 2;
+    }
+
+    return 0;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr,
+        "USAGE\n\n"
+        "    %s [-b steps] [-n steps] [-a ants] [-t threads] [-H] [-s seed]"
+        "\n        [-G WxH] [-U] [-F] [-R file] [-I steps] [rules]\n\n"
+        "OPTIONS\n\n"
+        "    -b <steps>     Run headless for <steps> steps and print timings\n"
+        "    -n <steps>     Steps per frame shown, adaptive by default\n"
+        "    -a <ants>      Number of ants, scattered at random\n"
+        "    -t <threads>   Threads stepping a swarm of ants\n"
+        "    -H             Step along highways instead of skipping them\n"
+        "    -s <seed>      Random seed, fixed to 1 when headless\n"
+        "    -G <WxH>       Grid size, defaults to 200x150\n"
+        "    -U             Unbounded world, shown around the ant\n"
+        "    -F             Fit the unbounded world to the window\n"
+        "    -R <file>      Record frames to a .y4m video, or to"
+        " <file>NNNNNN.ppm\n"
+        "    -I <steps>     Record every <steps>-th step, defaults to 1\n",
+        prog);
 }
 
 int main(int argc, char **argv)
 {
-    srand(time(NULL));
+    uint64_t benchmark_steps = 0;
+    uint64_t seed = 0;
+    int seeded = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:a:t:Hs:G:UFR:I:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            benchmark_steps = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            frame_steps = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            num_ants = atoi(optarg);
+            if (num_ants < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid number of ants '%s'\n",
+                    optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            if (atoi(optarg) < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid number of threads '%s'\n",
+                    optarg);
+                return 1;
+            }
+            omp_set_num_threads(atoi(optarg));
+            break;
+        case 'H':
+            highways = 0;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            seeded = 1;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%dx%d", &texture_w, &texture_h) != 2
+                || texture_w < 1 || texture_h < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid grid size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            unbounded = 1;
+            break;
+        case 'F':
+            view_fit = 1;
+            break;
+        case 'R':
+            export_path = optarg;
+            break;
+        case 'I':
+            export_interval = strtoull(optarg, NULL, 10);
+            if (export_interval == 0)
+            {
+                fprintf(stderr, "[ERROR] Invalid interval '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc - 1 == 0)
+    if (!seeded)
+        seed = benchmark_steps > 0 ? 1 : time(NULL);
+    srand(seed);
+
+    if (optind == argc)
         rules = "RL";
     else
-        rules = argv[1];
+        rules = argv[optind];
+
+    if (parse_rules(rules) == -1)
+        return 1;
+
+    if (unbounded && num_ants > 1)
+    {
+        fprintf(stderr, "[ERROR] Swarms need the grid, not -U\n");
+        return 1;
+    }
+
+    /* The unbounded world has no grid, and the pixel buffer is its view */
+    size_t cells = (size_t)texture_w * texture_h;
+
+    if (unbounded)
+        init_world();
+    else
+        cell_grid = (cell_t *)calloc(cells, sizeof(cell_t));
+
+    if (benchmark_steps == 0 || export_path)
+    {
+        pixels = (pixel_t *)malloc(cells * sizeof(pixel_t));
+        memset(pixels, 0xffffffff, cells * sizeof(pixel_t));
+
+        /* Nothing is dirty yet, the first upload covers the whole texture */
+        dirty_x0 = (int *)malloc(texture_h * sizeof(int));
+        dirty_x1 = (int *)calloc(texture_h, sizeof(int));
+        sent_x0 = (int *)malloc(texture_h * sizeof(int));
+        sent_x1 = (int *)calloc(texture_h, sizeof(int));
+        for (int y = 0; y < texture_h; y++)
+            dirty_x0[y] = sent_x0[y] = texture_w;
+    }
+
+    ant = (ant_t *)malloc(sizeof(ant_t));
+
+    init(ant, W);
+    if (num_ants > 1)
+        init_swarm();
+    if (unbounded && pixels)
+        draw_view(ant);
+
+    if (export_path)
+    {
+        if (export_start() == -1)
+            return 1;
+        export_frame();
+    }
+
+    if (benchmark_steps > 0)
+    {
+        benchmark(benchmark_steps, seed);
+        export_stop();
+        return 0;
+    }
 
     Uint32 flags = SDL_WINDOW_HIDDEN;
 
@@ -204,18 +2413,6 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    cell_grid = (cell_t *)calloc(texture_w * texture_h, sizeof(cell_t));
-
-    pixels = (pixel_t *)malloc(texture_w * texture_h * sizeof(pixel_t));
-
-    ant = (ant_t *)malloc(sizeof(ant_t));
-
-    /* Initialize cell states */
-    for (int x = 0; x < texture_w; x++)
-        for (int y = 0; y < texture_h; y++)
-            grid(x, y).state = 0;
-    memset(pixels, 0xffffffff, texture_w * texture_h * sizeof(pixel_t));
-
     /* Configure texture */
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
         SDL_TEXTUREACCESS_STREAMING, texture_w, texture_h);
@@ -241,7 +2438,7 @@ int main(int argc, char **argv)
             SDL_WINDOWPOS_CENTERED);
     SDL_ShowWindow(window);
 
-    init(ant, W, texture);
+    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
 
     printf("STATES\n");
     for (int i = 0; i < NUM_STATES; i++)
@@ -252,13 +2449,21 @@ int main(int argc, char **argv)
             states[i].hex
         );
 
+    for (int i = 0; i < 3; i++)
+        frames[i].pixels = (pixel_t *)malloc(
+            (size_t)texture_w * texture_h * sizeof(pixel_t));
+    SDL_AtomicSet(&frame_middle, 2);
+    SDL_AtomicSet(&quit, 0);
+
+    SDL_Thread *simulation = SDL_CreateThread(simulate, "simulation", NULL);
+
     SDL_bool done = SDL_FALSE;
     while (!done)
     {
+        upload_frame();
         SDL_RenderCopy(renderer, texture, NULL, &texture_rect);
         SDL_RenderPresent(renderer);
         SDL_Delay(SLEEPTIME);
-        iterate(ant, texture);
 
         SDL_Event event;
         while (SDL_PollEvent(&event))
@@ -279,6 +2484,10 @@ int main(int argc, char **argv)
         }
     }
 
+    SDL_AtomicSet(&quit, 1);
+    SDL_WaitThread(simulation, NULL);
+    export_stop();
+
     if (renderer)
         SDL_DestroyRenderer(renderer);
     if (window)
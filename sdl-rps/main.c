@@ -1,4 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <omp.h>
 #include <SDL.h>
@@ -30,6 +36,72 @@ pixel_t colors[NUM_OPTIONS] = {
     [SCISSOR] = 0xd9d9d9ff
 };
 
+uint64_t seed = 0;
+
+uint64_t generation = 0;
+
+/*
+ * Periodicity detection. grid_hash is a Zobrist hash of the grid, the XOR of
+ * one key per cell and state, kept up to date from the cells that change.
+ * Hashes of past generations are stored in a direct-mapped table. Since the
+ * dynamics are stochastic, a grid seen again may still leave the cycle, so a
+ * period is only reported once it held for CYCLE_CONFIRM periods in a row.
+ */
+#define HISTORY_SIZE (1 << 16)
+#define CYCLE_CONFIRM 8
+
+typedef struct {
+    uint64_t hash;
+    uint64_t seen; /* Generation + 1, 0 for empty slots */
+} history_t;
+
+enum {
+    CYCLES_OFF,
+    CYCLES_REPORT,
+    CYCLES_STOP
+};
+
+int detect_cycles = CYCLES_OFF;
+uint64_t grid_hash = 0;
+history_t *history = NULL;
+uint64_t candidate_start = 0;
+uint64_t candidate_period = 0;
+uint64_t cycle_start = 0;
+uint64_t cycle_period = 0; /* 0 until a cycle is confirmed */
+
+/*
+ * Grid files. With -M the grids live in a memory-mapped file instead of the
+ * heap, so the kernel pages them in and out as rows are stepped and grids may
+ * be larger than memory. After a header page, the file holds the two grids
+ * and two checkpoint slots. A checkpoint copies the rows changed since the
+ * slot was last written into the older slot, syncs it, then points the header
+ * to it, so only dirty pages are written and a crash during a checkpoint
+ * leaves the previous one intact.
+ * Opening an existing file resumes from its last checkpoint, with its seed,
+ * so the run continues exactly as if it had not been interrupted.
+ */
+#define GRID_MAGIC "RPSGRID"
+#define GRID_VERSION 1
+#define GRID_PAGE 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t width, height;
+    uint64_t seed;
+    uint64_t generation; /* Of the checkpoint */
+    uint32_t slot;       /* Holding the checkpoint */
+} grid_header_t;
+
+uint8_t *grid_map = NULL;
+size_t grid_map_size = 0;
+size_t grid_bytes = 0;          /* One grid, in whole pages */
+grid_header_t *grid_header = NULL;
+cell_t *grid_slots[2] = { NULL, NULL };
+/* Bit k is set if the row changed since slot k was saved */
+uint8_t *row_unsaved = NULL;
+uint64_t checkpoint_interval = 0;
+
 cell_t *cell_grid_a = NULL; /* Always points to the last modified grid */
 cell_t *cell_grid_b = NULL;
 
@@ -48,9 +120,37 @@ SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 SDL_Texture *texture = NULL;
 
-#define grid_a(x, y) cell_grid_a[(texture_w * (y)) + (x)]
-#define grid_b(x, y) cell_grid_b[(texture_w * (y)) + (x)]
-#define pixel(x, y) pixels[(texture_w * (y)) + (x)]
+#define grid_a(x, y) cell_grid_a[((size_t)texture_w * (y)) + (x)]
+#define grid_b(x, y) cell_grid_b[((size_t)texture_w * (y)) + (x)]
+#define pixel(x, y) pixels[((size_t)texture_w * (y)) + (x)]
+
+/*
+ * Span of each row repainted since the last frame, from dirty_x0 up to but
+ * not including dirty_x1. Rows are owned by a single thread while stepping.
+ */
+int *dirty_x0 = NULL;
+int *dirty_x1 = NULL;
+/* Spans repainted since the last frame taken, up to the previous frame */
+int *sent_x0 = NULL;
+int *sent_x1 = NULL;
+
+#define mark_dirty(x, y)            \
+do {                                \
+    if ((x) < dirty_x0[y])          \
+        dirty_x0[y] = (x);          \
+    if ((x) >= dirty_x1[y])         \
+        dirty_x1[y] = (x) + 1;      \
+} while (0)
+
+/* Headless runs have no pixel buffer */
+#define paint(x, y, c)              \
+do {                                \
+    if (pixels)                     \
+    {                               \
+        pixel(x, y) = colors[c];    \
+        mark_dirty(x, y);           \
+    }                               \
+} while (0)
 
 void swap(cell_t **a, cell_t **b)
 {
@@ -59,7 +159,7 @@ void swap(cell_t **a, cell_t **b)
     *b = c;
 }
 
-void perturbate_cell_grid_tri(SDL_Texture *texture)
+void perturbate_cell_grid_tri(void)
 {
     int cx, cy, dx, dy;
 
@@ -69,16 +169,14 @@ void perturbate_cell_grid_tri(SDL_Texture *texture)
     dy = texture_h / 4;
 
     grid_a(cx - dx, cy - dy).color = ROCK;
-    pixel(cx - dx, cy - dy)        = colors[ROCK];
+    paint(cx - dx, cy - dy, ROCK);
     grid_a(cx + dx, cy - dy).color = PAPER;
-    pixel(cx + dx, cy - dy)        = colors[PAPER];
+    paint(cx + dx, cy - dy, PAPER);
     grid_a(cx, cy + dy).color      = SCISSOR;
-    pixel(cx, cy + dy)             = colors[SCISSOR];
-
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+    paint(cx, cy + dy, SCISSOR);
 }
 
-void perturbate_cell_grid_rand(SDL_Texture *texture)
+void perturbate_cell_grid_rand(void)
 {
     int x, y, option;
     int num_cells_init = 50;
@@ -88,10 +186,23 @@ void perturbate_cell_grid_rand(SDL_Texture *texture)
         y = rand() % texture_h;
         option = (rand() % (NUM_OPTIONS - 1)) + 1; /* Exclude white */
         grid_a(x, y).color = option;
-        pixel(x, y) = colors[option];
+        paint(x, y, option);
     }
+}
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+/*
+ * Counter-based generator. Every cell draws its random numbers from a hash of
+ * the seed, the generation and its position, so the outcome of a generation
+ * does not depend on which thread evaluates which cell, or in what order.
+ */
+uint64_t cell_rand(int x, int y)
+{
+    uint64_t z = seed
+        + (generation * texture_w * texture_h + texture_w * y + x + 1)
+        * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
 }
 
 int beats(cell_t current, cell_t neighbor)
@@ -105,16 +216,20 @@ int beats(cell_t current, cell_t neighbor)
 
 cell_t next_cell(int x, int y)
 {
+    uint64_t r = cell_rand(x, y);
+    uint32_t rx = (uint32_t)r;
+    uint32_t ry = (uint32_t)(r >> 32);
+
 #ifdef RPS_CELL_ALL
     int d[3] = { -1, 0, 1 };
-    int dx = x + d[rand() % 3];
-    int dy = y + d[rand() % 3];
+    int dx = x + d[rx % 3];
+    int dy = y + d[ry % 3];
     if (dx == 0 && dy == 0)
         dy++;
 #elif RPS_CELL_DIAG
     int d[2] = { -1, 1 };
-    int dx = x + d[rand() % 2];
-    int dy = y + d[rand() % 2];
+    int dx = x + d[rx % 2];
+    int dy = y + d[ry % 2];
 #endif /* RPS_RULE_ALL */
 
     if (dx < 0)
@@ -159,23 +274,805 @@ cell_t next_cell(int x, int y)
     return next;
 }
 
-void evaluate_cell_grid(SDL_Texture *texture)
+/* Key of a cell and its state in the grid hash */
+uint64_t zobrist(int x, int y, cell_t cell)
 {
+    uint64_t z = (((uint64_t)texture_w * y + x) * NUM_OPTIONS * 8
+        + cell.color * 8 + cell.strength + 1) * 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+/* Hashes the grid from scratch and forgets the past generations */
+void reset_cycles(void)
+{
+    if (!detect_cycles)
+        return;
+
+    if (!history)
+        history = (history_t *)malloc(HISTORY_SIZE * sizeof(history_t));
+    memset(history, 0, HISTORY_SIZE * sizeof(history_t));
+    candidate_period = 0;
+    cycle_period = 0;
+
+    grid_hash = 0;
     for (int y = 0; y < texture_h; y++)
         for (int x = 0; x < texture_w; x++)
+            grid_hash ^= zobrist(x, y, grid_a(x, y));
+
+    history[grid_hash & (HISTORY_SIZE - 1)] =
+        (history_t){ grid_hash, generation + 1 };
+}
+
+/* Looks the current generation up in the history, then records it */
+void check_cycle(void)
+{
+    if (cycle_period)
+        return;
+
+    history_t *h = &history[grid_hash & (HISTORY_SIZE - 1)];
+
+    if (h->seen && h->hash == grid_hash)
+    {
+        uint64_t period = generation - (h->seen - 1);
+
+        if (period != candidate_period)
         {
+            candidate_period = period;
+            candidate_start = h->seen - 1;
+        }
+        else if (generation - candidate_start >= CYCLE_CONFIRM * period)
+        {
+            cycle_start = candidate_start;
+            cycle_period = period;
+            fprintf(stderr, "Cycle of period %llu from generation %llu\n",
+                (unsigned long long)cycle_period,
+                (unsigned long long)cycle_start);
+        }
+    }
+    else
+    {
+        candidate_period = 0;
+    }
+
+    h->hash = grid_hash;
+    h->seen = generation + 1;
+}
+
+/*
+ * Bytes of one w x h grid of a grid file, in whole pages, or 0 if the size is
+ * invalid or the file would not fit in memory
+ */
+size_t grid_file_bytes(int w, int h)
+{
+    if (w < 1 || h < 1)
+        return 0;
+
+    uint64_t row = (uint64_t)w * sizeof(cell_t);
+    if (row > ((SIZE_MAX - GRID_PAGE) / 4 - GRID_PAGE) / h)
+        return 0;
+
+    return (row * h + GRID_PAGE - 1) / GRID_PAGE * GRID_PAGE;
+}
+
+/*
+ * Maps the grid file, creating it if needed. Returns 1 if the grid was restored
+ * from an existing file, in which case its size, seed and generation replace
+ * the ones given on the command line, 0 for a new file and -1 on errors. A new
+ * file only gets its magic with its first checkpoint, see checkpoint().
+ */
+int open_grid_file(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "[ERROR] Could not open '%s'\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    grid_header_t header;
+    int restored = fstat(fd, &st) == 0 && st.st_size > 0;
+    int width = texture_w;
+    int height = texture_h;
+
+    if (restored)
+    {
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, GRID_MAGIC, sizeof(header.magic)) != 0
+            || header.version != GRID_VERSION)
+        {
+            fprintf(stderr, "[ERROR] '%s' is not a grid file\n", path);
+            close(fd);
+            return -1;
+        }
+        width = header.width;
+        height = header.height;
+    }
+
+    /* The header is only trusted once the file has the size it implies */
+    grid_bytes = grid_file_bytes(width, height);
+    grid_map_size = GRID_PAGE + 4 * grid_bytes;
+
+    if (grid_bytes == 0 || (restored ? (size_t)st.st_size != grid_map_size
+        : ftruncate(fd, grid_map_size) == -1))
+    {
+        fprintf(stderr, "[ERROR] '%s' does not have the expected size\n", path);
+        close(fd);
+        return -1;
+    }
+
+    texture_w = width;
+    texture_h = height;
+
+    grid_map = (uint8_t *)mmap(NULL, grid_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close(fd);
+    if (grid_map == MAP_FAILED)
+    {
+        fprintf(stderr, "[ERROR] Could not map '%s'\n", path);
+        return -1;
+    }
+
+    grid_header = (grid_header_t *)grid_map;
+    for (int k = 0; k < 2; k++)
+        grid_slots[k] = (cell_t *)(grid_map + GRID_PAGE + (2 + k) * grid_bytes);
+
+    if (restored)
+    {
+        seed = header.seed;
+        generation = header.generation;
+        memcpy(grid_map + GRID_PAGE, grid_slots[header.slot & 1], grid_bytes);
+        fprintf(stderr, "Restored generation %llu from '%s'\n",
+            (unsigned long long)generation, path);
+    }
+    else
+    {
+        grid_header->version = GRID_VERSION;
+        grid_header->width = texture_w;
+        grid_header->height = texture_h;
+    }
+
+    return restored;
+}
+
+/* Saves the grid into the older checkpoint slot and syncs it to disk */
+void checkpoint(void)
+{
+    int k = !grid_header->slot;
+    cell_t *slot = grid_slots[k];
+
+    for (int y = 0; y < texture_h; y++)
+    {
+        if (!(row_unsaved[y] & (1 << k)))
+            continue;
+
+        memcpy(&slot[(size_t)texture_w * y], &grid_a(0, y),
+            texture_w * sizeof(cell_t));
+        row_unsaved[y] &= ~(1 << k);
+    }
+
+    /* The slot must be on disk before the header points to it */
+    msync(slot, grid_bytes, MS_SYNC);
+
+    grid_header->seed = seed;
+    grid_header->generation = generation;
+    grid_header->slot = k;
+
+    /* Until its first checkpoint, a new file does not hold a grid */
+    memcpy(grid_header->magic, GRID_MAGIC, sizeof(grid_header->magic));
+    msync(grid_map, GRID_PAGE, MS_SYNC);
+}
+
+/* Rows are split into one contiguous band per thread */
+void evaluate_cell_grid(void)
+{
+    uint64_t hash = 0;
+
+    #pragma omp parallel for schedule(static) reduction(^:hash)
+    for (int y = 0; y < texture_h; y++)
+    {
+        int changed = 0;
+
+        for (int x = 0; x < texture_w; x++)
+        {
+            cell_t current = grid_a(x, y);
             cell_t next = next_cell(x, y);
+            if (next.color != current.color)
+                paint(x, y, next.color);
+            if (next.color != current.color
+                || next.strength != current.strength)
+            {
+                if (detect_cycles)
+                    hash ^= zobrist(x, y, current) ^ zobrist(x, y, next);
+                changed = 1;
+            }
             grid_b(x, y) = next;
-            pixel(x, y) = colors[next.color];
         }
 
-    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+        if (row_unsaved && changed)
+            row_unsaved[y] = 3;
+    }
+
     swap(&cell_grid_a, &cell_grid_b);
+    generation++;
+
+    if (detect_cycles)
+    {
+        grid_hash ^= hash;
+        check_cycle();
+    }
+
+    if (grid_map && checkpoint_interval
+        && generation % checkpoint_interval == 0)
+        checkpoint();
+}
+
+double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Frame export. With -R, the pixel buffer is copied into a bounded queue every
+ * -I steps, and a writer thread turns the queued frames into one Y4M video, or
+ * into a sequence of PPM images. A headless run waits for the writer when the
+ * queue is full, so that every frame is written. With a window, the simulation
+ * has a display to keep up with instead: the frame is dropped, and dropped
+ * frames are counted.
+ *
+ * This block is the same in all four programs but for the copy of the pixel
+ * buffer in export_frame(), and is best changed in all of them at once.
+ */
+#define EXPORT_QUEUE 16
+
+char *export_path = NULL;
+int export_y4m = 0;
+uint64_t export_interval = 1;
+uint64_t export_steps = 0;
+uint64_t export_written = 0;
+uint64_t export_dropped = 0;
+int export_failed = 0;
+
+pixel_t *export_queue[EXPORT_QUEUE];
+uint64_t export_numbers[EXPORT_QUEUE]; /* Step of each queued frame */
+int export_head = 0;    /* Oldest queued frame */
+int export_count = 0;
+int export_done = 0;
+SDL_mutex *export_lock = NULL;
+SDL_cond *export_cond = NULL;
+SDL_Thread *export_thread = NULL;
+FILE *export_file = NULL;
+uint8_t *export_bytes = NULL;
+
+/* Writes one frame as RGB, or as the three planes of a Y4M frame (BT.601) */
+int write_frame(pixel_t *frame, uint64_t number)
+{
+    size_t cells = (size_t)texture_w * texture_h;
+
+    for (size_t i = 0; i < cells; i++)
+    {
+        int r = frame[i] >> 24;
+        int g = (frame[i] >> 16) & 0xff;
+        int b = (frame[i] >> 8) & 0xff;
+
+        if (export_y4m)
+        {
+            export_bytes[i] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+            export_bytes[cells + i] =
+                128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+            export_bytes[2 * cells + i] =
+                128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+        }
+        else
+        {
+            export_bytes[3 * i] = r;
+            export_bytes[3 * i + 1] = g;
+            export_bytes[3 * i + 2] = b;
+        }
+    }
+
+    if (export_y4m)
+        return fputs("FRAME\n", export_file) == EOF
+            || fwrite(export_bytes, 3, cells, export_file) != cells ? -1 : 0;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%06llu.ppm", export_path,
+        (unsigned long long)number);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "P6\n%d %d\n255\n", texture_w, texture_h);
+    int ok = fwrite(export_bytes, 3, cells, f) == cells;
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+int export_writer(void *data)
+{
+    (void)data;
+
+    SDL_LockMutex(export_lock);
+    for (;;)
+    {
+        while (export_count == 0 && !export_done)
+            SDL_CondWait(export_cond, export_lock);
+        if (export_count == 0)
+            break;
+
+        /* The simulation never touches queued frames */
+        pixel_t *frame = export_queue[export_head];
+        uint64_t number = export_numbers[export_head];
+        SDL_UnlockMutex(export_lock);
+
+        if (!export_failed && write_frame(frame, number) == -1)
+        {
+            fprintf(stderr, "[ERROR] Could not write frame %llu to '%s'\n",
+                (unsigned long long)number, export_path);
+            export_failed = 1;
+        }
+        else if (!export_failed)
+        {
+            export_written++;
+        }
+
+        SDL_LockMutex(export_lock);
+        export_head = (export_head + 1) % EXPORT_QUEUE;
+        export_count--;
+        SDL_CondSignal(export_cond);
+    }
+    SDL_UnlockMutex(export_lock);
+
+    return 0;
+}
+
+int export_start(void)
+{
+    size_t len = strlen(export_path);
+    export_y4m = len > 4 && strcmp(export_path + len - 4, ".y4m") == 0;
+
+    if (export_y4m)
+    {
+        export_file = fopen(export_path, "wb");
+        if (export_file == NULL)
+        {
+            fprintf(stderr, "[ERROR] Could not open '%s'\n", export_path);
+            return -1;
+        }
+        fprintf(export_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+            texture_w, texture_h, FPS);
+    }
+
+    size_t cells = (size_t)texture_w * texture_h;
+    for (int i = 0; i < EXPORT_QUEUE; i++)
+        export_queue[i] = (pixel_t *)malloc(cells * sizeof(pixel_t));
+    export_bytes = (uint8_t *)malloc(cells * 3);
+
+    export_lock = SDL_CreateMutex();
+    export_cond = SDL_CreateCond();
+    export_thread = SDL_CreateThread(export_writer, "export", NULL);
+
+    return 0;
+}
+
+/* Queues the pixel buffer on every export_interval-th call */
+void export_frame(void)
+{
+    if (!export_path || export_steps++ % export_interval)
+        return;
+
+    /* Without a window, nothing is lost by waiting for a slot */
+    SDL_LockMutex(export_lock);
+    while (export_count == EXPORT_QUEUE && !window)
+        SDL_CondWait(export_cond, export_lock);
+    int tail = (export_head + export_count) % EXPORT_QUEUE;
+    int full = export_count == EXPORT_QUEUE;
+    SDL_UnlockMutex(export_lock);
+
+    if (full)
+    {
+        export_dropped++;
+        return;
+    }
+
+    memcpy(export_queue[tail], pixels,
+        (size_t)texture_w * texture_h * sizeof(pixel_t));
+    export_numbers[tail] = export_steps - 1;
+
+    SDL_LockMutex(export_lock);
+    export_count++;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+}
+
+/* Writes the queued frames and stops the writer */
+void export_stop(void)
+{
+    if (!export_path)
+        return;
+
+    SDL_LockMutex(export_lock);
+    export_done = 1;
+    SDL_CondSignal(export_cond);
+    SDL_UnlockMutex(export_lock);
+    SDL_WaitThread(export_thread, NULL);
+
+    if (export_file)
+        fclose(export_file);
+    fprintf(stderr, "Exported %llu frames, dropped %llu\n",
+        (unsigned long long)export_written,
+        (unsigned long long)export_dropped);
+}
+
+/* Runs n generations without rendering and prints one line of JSON */
+void benchmark(uint64_t n)
+{
+    uint64_t start = generation;
+    double wall = wall_time();
+    clock_t cpu = clock();
+
+    while (generation - start < n
+        && !(detect_cycles == CYCLES_STOP && cycle_period))
+    {
+        evaluate_cell_grid();
+        export_frame();
+    }
+
+    n = generation - start;
+
+    double cpu_s = (double)(clock() - cpu) / CLOCKS_PER_SEC;
+    double wall_s = wall_time() - wall;
+
+    uint64_t count[NUM_OPTIONS] = { 0 };
+    uint64_t checksum = 0xcbf29ce484222325;
+    for (int y = 0; y < texture_h; y++)
+        for (int x = 0; x < texture_w; x++)
+        {
+            count[grid_a(x, y).color]++;
+            checksum = (checksum ^ grid_a(x, y).color) * 0x100000001b3;
+            checksum = (checksum ^ grid_a(x, y).strength) * 0x100000001b3;
+        }
+
+    printf("{\"program\": \"sdl-rps\", "
+        "\"width\": %d, \"height\": %d, \"threads\": %d, "
+        "\"seed\": %llu, \"generations\": %llu, "
+        "\"wall_s\": %.6f, \"cpu_s\": %.6f, "
+        "\"generations_per_s\": %.3f, \"cell_updates_per_s\": %.3f, "
+        "\"white\": %llu, \"rock\": %llu, \"paper\": %llu, "
+        "\"scissor\": %llu, \"cycle_start\": %lld, \"cycle_period\": %llu, "
+        "\"checksum\": \"%016llx\"}\n",
+        texture_w, texture_h, omp_get_max_threads(),
+        (unsigned long long)seed, (unsigned long long)n,
+        wall_s, cpu_s, n / wall_s,
+        (double)n * texture_w * texture_h / wall_s,
+        (unsigned long long)count[WHITE], (unsigned long long)count[ROCK],
+        (unsigned long long)count[PAPER], (unsigned long long)count[SCISSOR],
+        cycle_period ? (long long)cycle_start : -1LL,
+        (unsigned long long)cycle_period, (unsigned long long)checksum);
+}
+
+/*
+ * Frames go from the simulation thread to the main thread through a lock-free
+ * triple buffer. The simulation thread owns the back buffer, the main thread
+ * the front one, and the middle one is exchanged atomically by both. A frame
+ * is published after every step, replacing the middle one if the main thread
+ * has not taken it yet, and FRAME_FRESH tells whether it did.
+ *
+ * A frame only carries the rectangles repainted since the last frame the main
+ * thread took, so that whichever frame it takes brings the texture in sync
+ * with the pixel buffer. Their pixels sit at the same place as in the pixel
+ * buffer, the rest of the frame buffer is stale and never read. The simulation
+ * keeps what it repainted since the previous frame apart, and folds it into
+ * what the next frame carries until a frame it published was taken.
+ */
+#define FRAME_FRESH 4
+#define MAX_RECTS 64
+
+typedef struct {
+    pixel_t *pixels;
+    SDL_Rect rects[MAX_RECTS];
+    int num_rects;
+} frame_t;
+
+frame_t frames[3];
+int frame_back = 0;     /* Simulation thread */
+int frame_front = 1;    /* Main thread */
+SDL_atomic_t frame_middle;
+
+SDL_atomic_t quit;
+
+/*
+ * Merges the spans repainted since the last frame taken into one rectangle per
+ * band of rows. Returns 0 if nothing was repainted since the previous frame.
+ */
+int collect_rects(frame_t *frame)
+{
+    int band = texture_h / MAX_RECTS + 1 > 16 ? texture_h / MAX_RECTS + 1 : 16;
+    int repainted = 0;
+
+    frame->num_rects = 0;
+    for (int y0 = 0; y0 < texture_h; y0 += band)
+    {
+        int x0 = texture_w, x1 = 0, y1 = y0, ya = -1;
+
+        for (int y = y0; y < y0 + band && y < texture_h; y++)
+        {
+            repainted |= dirty_x0[y] < dirty_x1[y];
+
+            int a = dirty_x0[y] < sent_x0[y] ? dirty_x0[y] : sent_x0[y];
+            int b = dirty_x1[y] > sent_x1[y] ? dirty_x1[y] : sent_x1[y];
+            if (a >= b)
+                continue;
+            if (ya < 0)
+                ya = y;
+            y1 = y + 1;
+            x0 = a < x0 ? a : x0;
+            x1 = b > x1 ? b : x1;
+        }
+
+        if (ya >= 0)
+            frame->rects[frame->num_rects++] =
+                (SDL_Rect){ x0, ya, x1 - x0, y1 - ya };
+    }
+
+    return repainted;
+}
+
+void publish_frame(void)
+{
+    frame_t *frame = &frames[frame_back];
+    if (!collect_rects(frame))
+        return;
+
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy(&frame->pixels[(size_t)texture_w * y + r->x],
+                &pixels[(size_t)texture_w * y + r->x], r->w * sizeof(pixel_t));
+    }
+
+    SDL_MemoryBarrierRelease();
+    int old = SDL_AtomicSet(&frame_middle, frame_back | FRAME_FRESH);
+    frame_back = old & 3;
+
+    /* Once the previous frame was taken, only this one may still be lost */
+    for (int y = 0; y < texture_h; y++)
+    {
+        if (old & FRAME_FRESH)
+        {
+            sent_x0[y] = dirty_x0[y] < sent_x0[y] ? dirty_x0[y] : sent_x0[y];
+            sent_x1[y] = dirty_x1[y] > sent_x1[y] ? dirty_x1[y] : sent_x1[y];
+        }
+        else
+        {
+            sent_x0[y] = dirty_x0[y];
+            sent_x1[y] = dirty_x1[y];
+        }
+        dirty_x0[y] = texture_w;
+        dirty_x1[y] = 0;
+    }
+}
+
+/* Uploads the newest frame, if one was published since the last call */
+void upload_frame(void)
+{
+    if (!(SDL_AtomicGet(&frame_middle) & FRAME_FRESH))
+        return;
+
+    frame_front = SDL_AtomicSet(&frame_middle, frame_front) & 3;
+    SDL_MemoryBarrierAcquire();
+
+    frame_t *frame = &frames[frame_front];
+    for (int i = 0; i < frame->num_rects; i++)
+    {
+        SDL_Rect *r = &frame->rects[i];
+        void *texels;
+        int pitch;
+
+        if (SDL_LockTexture(texture, r, &texels, &pitch) < 0)
+            continue;
+        for (int y = 0; y < r->h; y++)
+            memcpy((char *)texels + (size_t)pitch * y,
+                &frame->pixels[(size_t)texture_w * (r->y + y) + r->x],
+                r->w * sizeof(pixel_t));
+        SDL_UnlockTexture(texture);
+    }
+}
+
+int simulate(void *data)
+{
+    (void)data;
+
+    while (!SDL_AtomicGet(&quit))
+    {
+        /* Keep showing the cycle once it is found */
+        if (detect_cycles == CYCLES_STOP && cycle_period)
+        {
+            SDL_Delay(SLEEPTIME);
+            continue;
+        }
+
+        evaluate_cell_grid();
+        export_frame();
+        publish_frame();
+    }
+
+    return 0;
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr,
+        "USAGE\n\n"
+        "    %s [-t threads] [-b generations] [-s seed] [-G WxH] [-P] [-X]\n"
+        "        [-M file] [-C generations] [-R file] [-I generations]"
+        " [title]\n\n"
+        "OPTIONS\n\n"
+        "    -t <threads>   Number of stepping threads\n"
+        "    -b <gens>      Run headless for <gens> generations and print"
+        " timings\n"
+        "    -s <seed>      Random seed, fixed to 1 when headless\n"
+        "    -G <WxH>       Grid size, defaults to 200x150\n"
+        "    -P             Report when the grid enters a cycle\n"
+        "    -X             Stop once the grid enters a cycle\n"
+        "    -M <file>      Keep the grid in a memory-mapped file, resuming"
+        " from it if it exists\n"
+        "    -C <gens>      Checkpoint the grid file every <gens> generations\n"
+        "    -R <file>      Record frames to a .y4m video, or to"
+        " <file>NNNNNN.ppm\n"
+        "    -I <gens>      Record every <gens>-th generation, defaults to 1\n",
+        prog);
 }
 
 int main(int argc, char **argv)
 {
-    srand(time(NULL));
+    uint64_t benchmark_generations = 0;
+    int seeded = 0;
+    char *grid_path = NULL;
+    int restored = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:b:s:G:PXM:C:R:I:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            if (atoi(optarg) < 1)
+            {
+                fprintf(stderr, "[ERROR] Invalid number of threads '%s'\n",
+                    optarg);
+                return 1;
+            }
+            omp_set_num_threads(atoi(optarg));
+            break;
+        case 'b':
+            benchmark_generations = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            seeded = 1;
+            break;
+        case 'G':
+            if (sscanf(optarg, "%dx%d", &texture_w, &texture_h) != 2
+                || texture_w < 3 || texture_h < 3)
+            {
+                fprintf(stderr, "[ERROR] Invalid grid size '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            if (detect_cycles == CYCLES_OFF)
+                detect_cycles = CYCLES_REPORT;
+            break;
+        case 'X':
+            detect_cycles = CYCLES_STOP;
+            break;
+        case 'M':
+            grid_path = optarg;
+            break;
+        case 'C':
+            checkpoint_interval = strtoull(optarg, NULL, 10);
+            break;
+        case 'R':
+            export_path = optarg;
+            break;
+        case 'I':
+            export_interval = strtoull(optarg, NULL, 10);
+            if (export_interval == 0)
+            {
+                fprintf(stderr, "[ERROR] Invalid interval '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!seeded)
+        seed = benchmark_generations > 0 ? 1 : time(NULL);
+
+    if (grid_path && (restored = open_grid_file(grid_path)) == -1)
+        return 1;
+    srand(seed);
+
+    size_t cells = (size_t)texture_w * texture_h;
+
+    if (benchmark_generations == 0 || export_path)
+    {
+        pixels = (pixel_t *)malloc(cells * sizeof(pixel_t));
+
+        /* Initialize white */
+        memset(pixels, colors[WHITE], cells * sizeof(pixel_t));
+
+        /* Nothing is dirty yet, the first upload covers the whole texture */
+        dirty_x0 = (int *)malloc(texture_h * sizeof(int));
+        dirty_x1 = (int *)calloc(texture_h, sizeof(int));
+        sent_x0 = (int *)malloc(texture_h * sizeof(int));
+        sent_x1 = (int *)calloc(texture_h, sizeof(int));
+        for (int y = 0; y < texture_h; y++)
+            dirty_x0[y] = sent_x0[y] = texture_w;
+    }
+
+    if (grid_map)
+    {
+        cell_grid_a = (cell_t *)(grid_map + GRID_PAGE);
+        cell_grid_b = (cell_t *)(grid_map + GRID_PAGE + grid_bytes);
+
+        /*
+         * Each slot is saved whole the first time, except the one holding the
+         * checkpoint a grid was restored from
+         */
+        row_unsaved = (uint8_t *)malloc(texture_h);
+        memset(row_unsaved, restored ? 1 << !grid_header->slot : 3,
+            texture_h);
+    }
+    else
+    {
+        cell_grid_a = (cell_t *)calloc(cells, sizeof(cell_t));
+        cell_grid_b = (cell_t *)calloc(cells, sizeof(cell_t));
+    }
+
+    if (restored)
+    {
+        for (int y = 0; y < texture_h && pixels; y++)
+            for (int x = 0; x < texture_w; x++)
+                paint(x, y, grid_a(x, y).color);
+    }
+    else
+    {
+#ifdef RPS_INIT_TRI
+        perturbate_cell_grid_tri();
+#elif RPS_INIT_RAND
+        perturbate_cell_grid_rand();
+#endif /* RPS_INIT_TRI */
+
+        /* A new grid file is resumable from its first generation */
+        if (grid_map)
+            checkpoint();
+    }
+
+    reset_cycles();
+
+    if (export_path)
+    {
+        if (export_start() == -1)
+            return 1;
+        export_frame();
+    }
+
+    if (benchmark_generations > 0)
+    {
+        benchmark(benchmark_generations);
+        export_stop();
+        if (grid_map)
+            checkpoint();
+        return 0;
+    }
 
     Uint32 flags = SDL_WINDOW_HIDDEN;
 
@@ -193,14 +1090,6 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    pixels = (pixel_t *)malloc(texture_w * texture_h * sizeof(pixel_t));
-
-    cell_grid_a = (cell_t *)calloc(texture_w * texture_h, sizeof(cell_t));
-    cell_grid_b = (cell_t *)calloc(texture_w * texture_h, sizeof(cell_t));
-
-    /* Initialize white */
-    memset(pixels, colors[WHITE], texture_w * texture_h * sizeof(pixel_t));
-
     /* Configure texture */
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
         SDL_TEXTUREACCESS_STREAMING, texture_w, texture_h);
@@ -217,7 +1106,7 @@ int main(int argc, char **argv)
     SDL_SetRenderTarget(renderer, texture);
 
     /* Configure window */
-    SDL_SetWindowTitle(window, argv[1]);
+    SDL_SetWindowTitle(window, optind < argc ? argv[optind] : "");
     SDL_SetWindowSize(window, window_w, window_h);
     if (getenv("SDL_FULLSCREEN") != NULL)
         SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
@@ -226,19 +1115,23 @@ int main(int argc, char **argv)
             SDL_WINDOWPOS_CENTERED);
     SDL_ShowWindow(window);
 
-#ifdef RPS_INIT_TRI
-    perturbate_cell_grid_tri(texture);
-#elif RPS_INIT_RAND
-    perturbate_cell_grid_rand(texture);
-#endif /* RPS_INIT_TRI */
+    SDL_UpdateTexture(texture, NULL, pixels, texture_w * sizeof(pixel_t));
+
+    for (int i = 0; i < 3; i++)
+        frames[i].pixels = (pixel_t *)malloc(
+            (size_t)texture_w * texture_h * sizeof(pixel_t));
+    SDL_AtomicSet(&frame_middle, 2);
+    SDL_AtomicSet(&quit, 0);
+
+    SDL_Thread *simulation = SDL_CreateThread(simulate, "simulation", NULL);
 
     SDL_bool done = SDL_FALSE;
     while (!done)
     {
+        upload_frame();
         SDL_RenderCopy(renderer, texture, NULL, &texture_rect);
         SDL_RenderPresent(renderer);
         SDL_Delay(SLEEPTIME);
-        evaluate_cell_grid(texture);
 
         SDL_Event event;
         while (SDL_PollEvent(&event))
@@ -259,6 +1152,13 @@ int main(int argc, char **argv)
         }
     }
 
+    SDL_AtomicSet(&quit, 1);
+    SDL_WaitThread(simulation, NULL);
+    export_stop();
+
+    if (grid_map)
+        checkpoint();
+
     if (renderer)
         SDL_DestroyRenderer(renderer);
     if (window)